@@ -16,6 +16,18 @@
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glut.h>
@@ -23,21 +35,288 @@
 #include "DAMSONCRaytracer/raytracer.h"
 #include "DBSimulator/treeconsts.h"
 
+// A batch of raw triangle records read from a scenery file, waiting to be decoded.
+typedef struct SceneryBatch
+{
+    int *records;
+    int firstTriangle;
+    int noTriangles;
+    int materialIdx;
+}
+SceneryBatch;
+
+// Shared state for the threads decoding a round of scenery batches.
+typedef struct SceneryDecoder
+{
+    SceneryBatch *batches;
+    int *chunkBatch;
+    int *chunkStart;
+    int noChunks;
+    int nextChunk;
+}
+SceneryDecoder;
+
+// Shared state for the threads reading a scenery file's textures in the background.
+typedef struct TextureLoader
+{
+    char **filenames;
+    int firstTexture;
+    int noTextures;
+    int nextTexture;
+    int noThreads;
+    pthread_t threads[TEXTURE_LOADER_THREADS];
+}
+TextureLoader;
+
+// How far the background loaders have got. The loader threads publish their progress here
+// and the render thread picks it up; the fields are only touched with the lock held.
+typedef struct LoadingProgress
+{
+    pthread_mutex_t lock;
+    int stage;
+    int noTrianglesReady;
+    int sceneryDone;
+    int sceneryLoaded;
+}
+LoadingProgress;
+
+// Header of a scene cache file. The sections it points to are page aligned so the whole
+// file can be mapped and used in place.
+typedef struct SceneCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceSize;
+    uint64_t sourceModified;
+    uint64_t sourceHash;
+    uint64_t textureFilesStamp;
+    uint64_t fileSize;
+    int32_t noTriangles;
+    int32_t noMaterials;
+    int32_t noTextures;
+    int32_t reserved;
+    uint64_t positionOffset;
+    uint64_t normalOffset;
+    uint64_t intersectionOffset;
+    uint64_t uvOffset;
+    uint64_t objectMaterialOffset;
+    uint64_t materialOffset;
+    uint64_t textureOffset;
+    uint64_t textureDataOffsets[MAX_TEXTURES];
+}
+SceneCacheHeader;
+
+// Header of a compact tree file, followed straight away by noSections section entries.
+typedef struct TreeFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fileSize;
+    int32_t boundingBox[TREE_BOUNDING_BOX_ARRAY_SIZE];
+    int32_t splitListTop;
+    int32_t noSplitListEntries;
+    int32_t noTreeListEntries;
+    int32_t noTreeMatrixEntries;
+    int32_t noLeafPrimitives;
+    int32_t noSections;
+}
+TreeFileHeader;
+
+// Where a section of a compact tree file is. Readers skip any type they don't need.
+typedef struct TreeFileSection
+{
+    uint32_t type;
+    uint32_t noEntries;
+    uint64_t offset;
+    uint64_t size;
+}
+TreeFileSection;
+
+// A run of consecutive triangles sharing a material, drawn with a single call.
+typedef struct DrawBatch
+{
+    int firstTriangle;
+    int noTriangles;
+    int materialIdx;
+}
+DrawBatch;
+
+// A growable stack used to walk the tree without recursion. Each entry is width ints wide.
+typedef struct TraversalStack
+{
+    int *entries;
+    int size;
+    int capacity;
+    int width;
+}
+TraversalStack;
+
+// A subtree handed to a statistics thread, with its node counts at each depth below its root.
+typedef struct TreeStatsTask
+{
+    int rootIdx;
+    int *depthCounts;
+    int noDepthLevels;
+    int depthCapacity;
+}
+TreeStatsTask;
+
+// Shared state for the threads working through the subtrees.
+typedef struct TreeStatsEngine
+{
+    TreeStatsTask *tasks;
+    int noTasks;
+    int nextTask;
+    int baseDepth;
+    int applyOffsets;
+}
+TreeStatsEngine;
+
+// A loaded tree file. The views point into the file's mapping.
+typedef struct TreeContext
+{
+    char *filename;
+    void *mapping;
+    size_t mappingSize;
+    int boundingBox[TREE_BOUNDING_BOX_ARRAY_SIZE];
+    int (*treeMatrix)[TREE_MATRIX_SIZE];
+    int (*treeList)[TREE_LIST_SIZE];
+    int (*splitList)[SPLIT_LIST_SIZE];
+    int (*nodeList)[NODE_LIST_SIZE];
+    int splitListTop;
+    int noSplitListEntries;
+    int noTreeListEntries;
+    int noTreeMatrixEntries;
+    int noNodeListEntries;
+    int *leafPrimitiveOffsets;
+    int *leafPrimitives;
+    int noLeafPrimitives;
+}
+TreeContext;
+
+// The figures compared between trees built for the same scene.
+typedef struct TreeSummary
+{
+    int *depthCounts;
+    int noDepthLevels;
+    int noNodes;
+    int noLeaves;
+    int noEmptyLeaves;
+    int maxLeafPrimitives;
+    int leafOccupancy[LEAF_OCCUPANCY_BUCKETS];
+    long long noReferences;
+    long long noUniquePrimitives;
+    double sahCost;
+}
+TreeSummary;
+
+// Shared state for the threads summarising the loaded trees, one tree per task.
+typedef struct TreeComparisonEngine
+{
+    TreeContext *trees;
+    TreeSummary *summaries;
+    int noTasks;
+    int nextTask;
+}
+TreeComparisonEngine;
+
+// An entry on a ray's traversal stack: the far child of a split and the stretch of the ray within it.
+typedef struct RayStackEntry
+{
+    int nodeIdx;
+    float tNear;
+    float tFar;
+}
+RayStackEntry;
+
+// An entry on a packet's traversal stack, with the stretch of each ray within the far child.
+typedef struct RayPacketStackEntry
+{
+    int nodeIdx;
+    float tNear[RAY_PACKET_SIZE];
+    float tFar[RAY_PACKET_SIZE];
+}
+RayPacketStackEntry;
+
+// Shared state for the threads casting rays.
+typedef struct RayCaster
+{
+    int tilesAcross;
+    int noTiles;
+    int nextTile;
+    int usePackets;
+    int *hits;
+}
+RayCaster;
+
 // Prototype functions
 void computeScenePosition(void);
+int writeBoundaryBox(float *vertices, float bbvec[6], int splitAxis, float splitPos);
 void DrawBoundaryBox(float bbvec[6], int splitAxis, float splitPos, int nodeidx);
+void initialiseStack(TraversalStack *stack, int width);
+int *pushStack(TraversalStack *stack);
+int *popStack(TraversalStack *stack);
+void freeStack(TraversalStack *stack);
+void computeNodeBounds(void);
+float nodeSurfaceArea(float bbvec[6]);
+void computeNodeCosts(void);
+void setupCamera(void);
+void initialiseHitData(float hitData[HIT_DATA_SIZE]);
+void completeHitData(const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE]);
+int intersectTriangle(int triangleIdx, const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE]);
+int intersectLeaf(const int *primitives, int noPrimitives, const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE]);
+#ifdef __SSE2__
+void intersectTrianglePacket(int triangleIdx, const __m128 origin[3], const __m128 direction[3], __m128 active, __m128 *distance, __m128i *hitIdx, __m128 *mu, __m128 *mv);
+#endif
+int castRay(const float ray[RAY_VECTOR_SIZE], RayStackEntry *stack, unsigned int *nodeVisits, int stats[RAY_STATS_SIZE], float hitData[HIT_DATA_SIZE], int *hitLeafIdx);
+void castRayPacket(float rays[RAY_PACKET_SIZE][RAY_VECTOR_SIZE], RayPacketStackEntry *packetStack, RayStackEntry *stack, unsigned int *nodeVisits, int *stats[RAY_PACKET_SIZE], float hitData[RAY_PACKET_SIZE][HIT_DATA_SIZE]);
+void pixelRay(int px, int py, float ray[RAY_VECTOR_SIZE]);
+void *_childCastRays(void *arg);
+double traceImage(int usePackets, int *hits);
+void computeMeasuredCosts(void);
+int CastRays(void);
+int RunRayBenchmark(void);
+int PickScene(int xmouse, int ymouse);
+void heatColour(float value, GLubyte colour[3]);
+void buildBoxGeometry(void);
+void setBoxColour(int nodeIdx, int selected);
+void selectNode(int nodeIdx);
+void extractFrustum(float planes[FRUSTUM_PLANES][4]);
+int classifyBox(const float bbvec[TREE_BOUNDING_BOX_ARRAY_SIZE], float planes[FRUSTUM_PLANES][4], int planeMask);
+void cullSceneToFrustum(void);
 void DrawBoxes(void);
-void _childDrawBoxes(int currIdx, float nodeBB[6]);
-void DrawSquareNode(float x, float y, int nodeIdx);
-void DrawLinesNode(float startx, float starty, float endx, float endy);
+void computeTreeLayout(void);
+void buildTreeGeometry(void);
+void treeNodeColour(int nodeIdx, int selected, GLubyte colour[4]);
+void setTreeNodeColour(int nodeIdx, int selected);
+void recolourTreeNodes(void);
 void DrawTree(void);
-void _childDrawTree(int currIdx, int depth);
+int collectVisibleTreeNodes(int *noGlyphs, int *noQuads, int *noLines);
+void zoomTreeView(int xmouse, int ymouse, float factor);
+void fitTreeView(void);
 void initialiseTreeDepthCounter(void);
-void populateTreeDepthCounter(void);
-void _childTreeDepthCounter(int nodeIdx, int depth);
+void growTreeDepthCounter(int depth);
 void initialiseTreeNodeCounter(void);
-void populateTreeNodeCounter(void);
-int _childTreeNodeCounter(int nodeIdx);
+int countLeafPrimitives(int nodeIdx);
+int countSubtreeStatistics(TreeStatsTask *task, int baseDepth, TraversalStack *stack);
+void offsetSubtreeDepthIndices(TreeStatsTask *task, int baseDepth, TraversalStack *stack);
+void *_childTreeStatistics(void *arg);
+void populateTreeStatistics(void);
+void buildTreeDepthTables(void);
+int treeNodeAt(float xpos, float ypos);
+int summariseTree(TreeContext *tree, TreeSummary *summary, TraversalStack *stack);
+void *_childCompareTrees(void *arg);
+int CompareTrees(void);
+void printTreeComparison(void);
+void requestRedraw(int reasons);
+void movementTimerFunc(int value);
+void publishLoadingStage(int stage);
+void publishTrianglesReady(void);
+void *_childLoadTrees(void *arg);
+void *_childLoadScenery(void *arg);
+void startLoaders(void);
+void loadingTimerFunc(int value);
+int loadingFinished(void);
 void mainWindowRenderer(void);
 void reshapeFunc(int newWidth, int newHeight);
 void idleFunc(void);
@@ -53,12 +332,47 @@ void mouseFunc(int button, int state, int xmouse, int ymouse);
 void mouseMoveFunc(int xmouse, int ymouse);
 void mouseTreeFunc(int button, int state, int xmouse, int ymouse);
 void mouseMoveTreeFunc(int xmouse, int ymouse);
-void LoadTree(char *filename);
+void LoadTree(char *filename, TreeContext *tree);
+void buildLeafPrimitiveArrays(TreeContext *tree);
+void useTree(TreeContext *tree);
+int encodeVarint(unsigned char *buffer, uint32_t value);
+int decodeVarint(const unsigned char **cursor, const unsigned char *end, uint32_t *value);
+size_t encodeIntTable(unsigned char *buffer, const int *table, int noEntries, int width, int indexField);
+void loadCompactTree(char *filename, TreeContext *tree);
+int WriteCompactTree(char *filename, TreeContext *tree);
+void *growObjectStream(void *stream, size_t elementSize, int newCapacity);
+int growObjectDB(int required);
+int getThreadCount(void);
+int runWorkerThreads(void *(*worker)(void *), void *arg, int noTasks);
+void convertFixedPointBlock(const int *source, float *destination, int count);
+void decodeSceneryChunk(SceneryBatch *batch, int start, int count, float *values);
+void *_childDecodeScenery(void *arg);
+int decodeSceneryBatches(SceneryBatch *batches, int noBatches);
 int LoadScenery(char *filename);
+uint64_t mixHashWord(uint64_t value);
+int hashFileWords(char *filename, uint64_t *hash);
+uint64_t stampTextureFiles(char **filenames, int noFilenames);
+int LoadSceneCache(char *cacheFilename, struct stat *sourceStats, uint64_t sourceHash, uint64_t textureFilesStamp);
+int writeCacheSection(FILE *fp, const void *data, size_t size, uint64_t *offset);
+void WriteSceneCache(char *cacheFilename, struct stat *sourceStats, uint64_t sourceHash, uint64_t textureFilesStamp);
 void ReadTexture(int textureIdx, char *filename);
+void *_childReadTextures(void *arg);
+void startTextureLoader(TextureLoader *loader);
+void finishTextureLoader(TextureLoader *loader);
+void uploadTextures(void);
+int materialTexture(int materialIdx);
 void setMaterial(int materialIdx, int textureIdx);
+void streamSceneBuffers(void);
 void DrawScene(void);
+void DrawRayCostImage(void);
 void DisplayNodeInfo(void);
+void DisplaySceneryProgress(void);
+void drawPanelText(int xpos, int ypos, const char *string);
+void drawComparisonRow(int ypos, const char *name, double valueA, double valueB, int decimals);
+void DrawTreeComparison(void);
+void writeJSONString(FILE *fp, const char *string);
+void writeCSVString(FILE *fp, const char *string);
+int WriteTreeStatistics(char *treeFilename, char *sceneFilename);
 
 // Global variables
 int mainWindow, treeSubWindow, sceneSubWindow;
@@ -68,16 +382,42 @@ float deltaAngleX = 0.0, deltaAngleY = 0.0, deltaMoveFB = 0.0, deltaMoveLR = 0.0
 // Camera angles
 float lx = 0.0, ly = 0.0, lz = -1.0; 
 
+// Frame scheduling. Each sub window remembers why it needs redrawing, if it does at all.
+int TreeViewDirty = 0, SceneViewDirty = 0, MovementTimerActive = 0;
+
 // Tree variables
 float StatsVector[STATS_VECTOR_SIZE];
-float ObjectDB[MAX_TRIANGLES][TRIANGLE_SIZE];
+
+// The object database, split into streams so that each consumer only reads what it needs.
+float (*ObjectPositions)[POSITION_SIZE] = NULL;
+float (*ObjectNormals)[NORMAL_SIZE] = NULL;
+float (*ObjectIntersections)[INTERSECTION_SIZE] = NULL;
+float (*ObjectUVs)[UV_SIZE] = NULL;
+int *ObjectMaterials = NULL;
+
+// Scene geometry held on the GPU by the scene sub window.
+GLuint ScenePositionBuffer = 0, SceneNormalBuffer = 0, SceneUVBuffer = 0;
+DrawBatch *SceneDrawBatches = NULL;
+int noSceneDrawBatches = 0;
+// How many triangles have been handed to GL so far, how many the buffers have room for and
+// whether the textures have followed them:
+int SceneTrianglesUploaded = 0, SceneBufferCapacity = 0, SceneTexturesUploaded = 0;
+
 float MaterialDB[MAX_MATERIALS][MATERIAL_SIZE];
 int TextureDB[MAX_TEXTURES][TEXTURE_SIZE];
 int SceneBoundingBox[TREE_BOUNDING_BOX_ARRAY_SIZE];
-int TreeMatrix[MAX_BOUNDING_BOXES][TREE_MATRIX_SIZE];
-int TreeList[MAX_TRIANGLES][TREE_LIST_SIZE];
-int SplitList[MAX_TRIANGLES * 2 + 8][SPLIT_LIST_SIZE];
-int NodeList[MAX_TRIANGLES * 20][NODE_LIST_SIZE];
+
+// Views onto the memory mapped file of the tree in use. These are set by useTree.
+int (*TreeMatrix)[TREE_MATRIX_SIZE] = NULL;
+int (*TreeList)[TREE_LIST_SIZE] = NULL;
+int (*SplitList)[SPLIT_LIST_SIZE] = NULL;
+int (*NodeList)[NODE_LIST_SIZE] = NULL;
+
+// Leaf primitives flattened out of the node list chains. The primitives of node n
+// are LeafPrimitives[LeafPrimitiveOffsets[n]] to LeafPrimitives[LeafPrimitiveOffsets[n + 1] - 1].
+int *LeafPrimitiveOffsets = NULL;
+int *LeafPrimitives = NULL;
+int noLeafPrimitives = 0;
 
 // Counters for the above lists.
 int SplitListTop = 0;
@@ -88,22 +428,119 @@ int noNodeListEntries = 0;
 int noTriangles = 0;
 int noMaterials = 0;
 int noTextures = 0;
+int ObjectDBCapacity = 0;
+
+// Every tree given with -tree. The first is the one in use; the others are only compared with it.
+TreeContext Trees[MAX_COMPARED_TREES];
+TreeSummary TreeSummaries[MAX_COMPARED_TREES];
+int noTrees = 0, ShowTreeComparison = 0;
+// Where the name, A, B and difference columns of the comparison panel start:
+const int ComparisonColumns[4] = {5, 170, 245, 320};
+
+// Set when the object streams point into a mapped scene cache rather than the heap.
+int ObjectDBMapped = 0;
+char *SceneCacheFilename = 0;
+
+// Set by -convert to write the tree out as a compact tree file and stop.
+char *ConvertFilename = 0;
+
+// The files given on the command line, kept for the loader threads.
+char *TreeFilenames[MAX_COMPARED_TREES] = {0}, *SceneFilename = 0;
+
+// Background loading. Loading is shared with the loader threads. The rest is the render
+// thread's copy of it, taken by loadingTimerFunc, and is what the views and input go by.
+LoadingProgress Loading = {PTHREAD_MUTEX_INITIALIZER, LOADING_TREES, 0, 0, 0};
+int ViewLoadingStage = LOADING_TREES, ViewTrianglesReady = 0, ViewSceneryDone = 0;
+const char *LoadingStageNames[LOADING_DONE] = {"reading trees", "counting nodes", "laying out tree view", "building node boxes", "computing SAH costs", "comparing trees"};
+
+// Headless mode skips the GLUT window and writes the tree statistics out instead.
+int HeadlessMode = 0, StatsFormat = STATS_FORMAT_JSON;
+char *StatsFilename = 0;
+// Where the statistics go when there's no StatsFilename. Headless runs keep this for the
+// statistics alone and send everything else that would go to stdout to stderr instead.
+FILE *StatsOutput = NULL;
 
 // Tree stat counter:
-int TreeDepthCounter[MAX_TREE_DEPTH + 1];
+// The per-depth counter grows with the depth of the loaded tree.
+int *TreeDepthCounter = NULL;
+int noTreeDepthLevels = 0, TreeDepthCapacity = 0;
 int TreeDepthMaxCount = 0;
-int TreeNodeCounter[MAX_TRIANGLES * 20];
-int TreeDepthCurrentProgress[MAX_TREE_DEPTH + 1];
-int TreeDepthAssignment[MAX_TRIANGLES * 20];
+int *TreeNodeCounter = NULL;
+int *TreeDepthAssignment = NULL;
+int *TreeDepthIndex = NULL;
+
+// Nodes ordered by depth and then by index within that depth. The nodes at depth d are
+// TreeDepthNodes[TreeDepthOffsets[d]] to TreeDepthNodes[TreeDepthOffsets[d + 1] - 1].
+int *TreeDepthOffsets = NULL;
+int *TreeDepthNodes = NULL;
+
+// Tree view layout. Node positions are worked out once and then drawn from vertex buffers.
+float (*TreeLayout)[2] = NULL;
+float *TreeNodeVertices = NULL, *TreeLineVertices = NULL;
+GLubyte *TreeNodeColours = NULL;
+int noTreeLineVertices = 0, TreeBuffersReady = 0, TreeHighlightIdx = -1;
+GLuint TreeNodeVertexBuffer = 0, TreeNodeColourBuffer = 0, TreeLineVertexBuffer = 0;
+
+// Tree view panning and zooming: the layout point at the view's origin and the pixels per
+// unit of layout. The pan origin is where the mouse was when the right button went down.
+float TreeViewOrigin[2] = {0.0, 0.0}, TreeViewZoom = 1.0;
+int TreeViewPanX = -1, TreeViewPanY = -1;
+
+// What's needed to draw only the visible part of the tree: how far across the subtree below
+// every node reaches, how many nodes it holds and where the node's lines start in the line
+// buffer. The rest is scratch space for each draw, some of it kept per depth.
+float (*TreeSubtreeExtent)[2] = NULL;
+int *TreeSubtreeSize = NULL, *TreeLineStart = NULL, *TreeViewStack = NULL, *TreeViewGlyphs = NULL, *TreeViewGlyphCounts = NULL;
+GLuint *TreeVisibleQuads = NULL, *TreeVisibleLines = NULL;
+int *TreeViewLastColumn = NULL, *TreeViewLastGlyph = NULL;
+float *TreeViewLabelEnd = NULL;
 
 int SelectedNodeIdx = 0, SelectedSplitAxis = 0;
 float SelectedBBVec[6] = {0, 0, 0, 0, 0, 0}, SelectedSplitPosition = 0.0;
 
+// Bounds of every node, worked out from the scene bounding box and the splits above it.
+float (*NodeBounds)[TREE_BOUNDING_BOX_ARRAY_SIZE] = NULL;
+
+// Surface area heuristic cost of the subtree below every node, and the constants used.
+float *NodeCosts = NULL;
+float SAHTraversalCost = SAH_TRAVERSAL_COST, SAHIntersectionCost = SAH_INTERSECTION_COST;
+
+// Ray caster results: visits to every node, the work each ray took and the image of its cost.
+float Camera[CAMERA_SIZE], RayCastFoV = RAYCAST_FOV;
+unsigned int *NodeVisitCounts = NULL, NodeVisitMax = 0;
+float *NodeMeasuredCosts = NULL;
+int (*RayStats)[RAY_STATS_SIZE] = NULL;
+GLubyte *RayCostImage = NULL;
+int RaysCast = 0, ShowRayHeatmap = 0, TreeColoursStale = 0, RayCastPackets = 1, BenchmarkMode = 0;
+
+// Box and split plane lines for every junction node. The vertices are built at load time
+// and handed to GL on the first draw, after which only the highlight colour changes. A node
+// without a valid split axis only has its box, so each node keeps its own vertex count.
+float *BoxVertices = NULL;
+GLubyte *BoxColours = NULL;
+int *BoxVertexStart = NULL, *BoxVertexCount = NULL;
+int noBoxVertices = 0, BoxBuffersReady = 0, BoxHighlightIdx = -1;
+GLuint BoxVertexBuffer = 0, BoxColourBuffer = 0;
+
+// Frustum culling of the scene view. Each frame the tree is walked against the camera's
+// frustum to find the leaves and junction boxes inside it. Triangles held by more than one
+// leaf are only drawn once: each is stamped with the frame that last drew it. The visible
+// triangles are drawn in material batches, so each triangle also knows its batch.
+float SceneFrustum[FRUSTUM_PLANES][4];
+TraversalStack SceneCullStack = {NULL, 0, 0, 0};
+int *SceneVisibleLeaves = NULL, noSceneVisibleLeaves = 0;
+GLuint *SceneVisibleBoxIndices = NULL;
+int noSceneVisibleBoxIndices = 0;
+unsigned int *SceneTriangleStamps = NULL, SceneCullFrame = 0;
+int *SceneTriangleBatches = NULL, *SceneBatchEnds = NULL, *SceneVisibleTriangles = NULL;
+GLuint *SceneVisibleIndices = NULL;
+
 
-// A container for textures.
+// A container for textures. The pixels are 8-bit RGBA, and name is the GL texture once uploaded.
 typedef struct Texture
 {
-    int *data;
+    unsigned char *data;
+    GLuint name;
 }
 Texture;
 
@@ -117,11 +554,34 @@ void computeScenePosition(void)
     z += deltaMoveFB * lz * 0.1;
 }
 
-// Draws a boundary box given these conditions:
-void DrawBoundaryBox(float bbvec[6], int splitAxis, float splitPos, int nodeIdx)
+// Writes the lines of a boundary box (and its split, if splitAxis isn't negative) to vertices.
+// Returns the number of vertices written, which is at most BOX_VERTICES_PER_NODE.
+int writeBoundaryBox(float *vertices, float bbvec[6], int splitAxis, float splitPos)
 {
     float mins[3], maxs[3];
-    int n;
+    int n, count = 0;
+    
+    // Each line is a pair of corners, picked from the mins (0) or maxs (1) per axis:
+    static const int boxLines[24][3] = {
+        {0, 0, 0}, {1, 0, 0},   // AB
+        {0, 0, 0}, {0, 0, 1},   // AC
+        {0, 0, 0}, {0, 1, 0},   // AE
+        {1, 0, 0}, {1, 0, 1},   // BD
+        {1, 0, 0}, {1, 1, 0},   // BH
+        {0, 0, 1}, {1, 0, 1},   // CD
+        {0, 0, 1}, {0, 1, 1},   // CF
+        {1, 0, 1}, {1, 1, 1},   // DG
+        {0, 1, 0}, {0, 1, 1},   // EF
+        {0, 1, 0}, {1, 1, 0},   // EH
+        {0, 1, 1}, {1, 1, 1},   // FG
+        {1, 1, 1}, {1, 1, 0}    // GH
+    };
+    // The four lines of the split plane for each axis, once it has been flattened:
+    static const int splitLines[3][8][3] = {
+        {{0, 0, 0}, {0, 0, 1}, {0, 0, 0}, {0, 1, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {0, 1, 1}},  // AC, AE, CF, EF
+        {{0, 0, 0}, {1, 0, 0}, {0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1}, {1, 0, 1}},  // AB, AC, BD, CD
+        {{0, 0, 0}, {1, 0, 0}, {0, 0, 0}, {0, 1, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {1, 1, 0}}   // AB, AE, BH, EH
+    };
     
     // Compute the min and max cases:
     for (n = 0; n < 3; n++)
@@ -130,6 +590,39 @@ void DrawBoundaryBox(float bbvec[6], int splitAxis, float splitPos, int nodeIdx)
         maxs[n] = bbvec[n] + bbvec[n + 3];
     }
     
+    // Outside box first:
+    for (n = 0; n < 24; n++, count++)
+    {
+        vertices[count * 3 + 0] = boxLines[n][0] ? maxs[0] : mins[0];
+        vertices[count * 3 + 1] = boxLines[n][1] ? maxs[1] : mins[1];
+        vertices[count * 3 + 2] = boxLines[n][2] ? maxs[2] : mins[2];
+    }
+    
+    if (splitAxis < 0 || splitAxis > 2)
+        return count;
+    
+    // Finally, get the split right:
+    mins[splitAxis] = splitPos;
+    maxs[splitAxis] = splitPos;
+    
+    for (n = 0; n < 8; n++, count++)
+    {
+        vertices[count * 3 + 0] = splitLines[splitAxis][n][0] ? maxs[0] : mins[0];
+        vertices[count * 3 + 1] = splitLines[splitAxis][n][1] ? maxs[1] : mins[1];
+        vertices[count * 3 + 2] = splitLines[splitAxis][n][2] ? maxs[2] : mins[2];
+    }
+    
+    return count;
+}
+
+// Draws a boundary box given these conditions:
+void DrawBoundaryBox(float bbvec[6], int splitAxis, float splitPos, int nodeIdx)
+{
+    float vertices[BOX_VERTICES_PER_NODE * 3];
+    int n, count;
+    
+    count = writeBoundaryBox(vertices, bbvec, splitAxis, splitPos);
+    
     // Start drawing outside box:
     if (nodeIdx == SelectedNodeIdx)
         glColor3f(AABB_DRAW_LINE_SELECTED_COLOUR_R, AABB_DRAW_LINE_SELECTED_COLOUR_G, AABB_DRAW_LINE_SELECTED_COLOUR_B);
@@ -137,1105 +630,4782 @@ void DrawBoundaryBox(float bbvec[6], int splitAxis, float splitPos, int nodeIdx)
         glColor3f(AABB_DRAW_LINE_COLOUR_R, AABB_DRAW_LINE_COLOUR_G, AABB_DRAW_LINE_COLOUR_B);
     glPushMatrix();
     glBegin(GL_LINES);
-        // AB
-        glVertex3f(mins[0], mins[1], mins[2]);
-        glVertex3f(maxs[0], mins[1], mins[2]);
-        // AC
-        glVertex3f(mins[0], mins[1], mins[2]);
-        glVertex3f(mins[0], mins[1], maxs[2]);
-        // AE
-        glVertex3f(mins[0], mins[1], mins[2]);
-        glVertex3f(mins[0], maxs[1], mins[2]);
-        // BD
-        glVertex3f(maxs[0], mins[1], mins[2]);
-        glVertex3f(maxs[0], mins[1], maxs[2]);
-        // BH
-        glVertex3f(maxs[0], mins[1], mins[2]);
-        glVertex3f(maxs[0], maxs[1], mins[2]);
-        // CD
-        glVertex3f(mins[0], mins[1], maxs[2]);
-        glVertex3f(maxs[0], mins[1], maxs[2]);
-        // CF
-        glVertex3f(mins[0], mins[1], maxs[2]);
-        glVertex3f(mins[0], maxs[1], maxs[2]);
-        // DG
-        glVertex3f(maxs[0], mins[1], maxs[2]);
-        glVertex3f(maxs[0], maxs[1], maxs[2]);
-        // EF
-        glVertex3f(mins[0], maxs[1], mins[2]);
-        glVertex3f(mins[0], maxs[1], maxs[2]);
-        // EH
-        glVertex3f(mins[0], maxs[1], mins[2]);
-        glVertex3f(maxs[0], maxs[1], mins[2]);
-        // FG
-        glVertex3f(mins[0], maxs[1], maxs[2]);
-        glVertex3f(maxs[0], maxs[1], maxs[2]);
-        // GH
-        glVertex3f(maxs[0], maxs[1], maxs[2]);
-        glVertex3f(maxs[0], maxs[1], mins[2]);
-        
-        // Finally, get the split right:
-        mins[splitAxis] = splitPos;
-        maxs[splitAxis] = splitPos;
-        
-        switch(splitAxis)
-        {
-            case 0:
-                // AC
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(mins[0], mins[1], maxs[2]);
-                // AE
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(mins[0], maxs[1], mins[2]);
-                // CF
-                glVertex3f(mins[0], mins[1], maxs[2]);
-                glVertex3f(mins[0], maxs[1], maxs[2]);
-                // EF
-                glVertex3f(mins[0], maxs[1], mins[2]);
-                glVertex3f(mins[0], maxs[1], maxs[2]);
-                break;
-            case 1:
-                // AB
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(maxs[0], mins[1], mins[2]);
-                // AC
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(mins[0], mins[1], maxs[2]);
-                // BD
-                glVertex3f(maxs[0], mins[1], mins[2]);
-                glVertex3f(maxs[0], mins[1], maxs[2]);
-                // CD
-                glVertex3f(mins[0], mins[1], maxs[2]);
-                glVertex3f(maxs[0], mins[1], maxs[2]);
-                break;
-            case 2:
-                // AB
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(maxs[0], mins[1], mins[2]);
-                // AE
-                glVertex3f(mins[0], mins[1], mins[2]);
-                glVertex3f(mins[0], maxs[1], mins[2]);
-                // BH
-                glVertex3f(maxs[0], mins[1], mins[2]);
-                glVertex3f(maxs[0], maxs[1], mins[2]);
-                // EH
-                glVertex3f(mins[0], maxs[1], mins[2]);
-                glVertex3f(maxs[0], maxs[1], mins[2]);
-        }
+        for (n = 0; n < count; n++)
+            glVertex3fv(&vertices[n * 3]);
     glEnd();
     glPopMatrix();
     
 }
 
-void DrawBoxes(void)
+// Sets up an empty traversal stack.
+void initialiseStack(TraversalStack *stack, int width)
 {
-    float sceneBox[6];
-    int n;
-    
-    // Transform the main scene bounding box variable from fixed point to floating point.
-    for (n = 0; n < 6; n++)
-        sceneBox[n] = (float)SceneBoundingBox[n] / 65536.0;
-    
-    _childDrawBoxes(0, sceneBox);
-    
-    // Finally, draw the highlighted one.
-    DrawBoundaryBox(SelectedBBVec, SelectedSplitAxis, SelectedSplitPosition, SelectedNodeIdx);
+    stack->entries = NULL;
+    stack->size = 0;
+    stack->capacity = 0;
+    stack->width = width;
 }
 
-void _childDrawBoxes(int currIdx, float nodeBB[6])
+// Pushes a new entry onto the stack and returns it for filling in.
+int *pushStack(TraversalStack *stack)
 {
-    float newBB[6], splitPos;
-    int splitAxis;
+    int *entries;
     
-    // Does this node have children?
-    if (TreeMatrix[currIdx][TREE_MATRIX_LEAF_NODE] < 0)
+    if (stack->size == stack->capacity)
     {
-        // Extract and convert the split position and axis:
-        splitPos = (float) TreeMatrix[currIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0;
-        splitAxis = TreeMatrix[currIdx][TREE_MATRIX_AXIS_INDEX];
-        
-        // Draw this box:
-        if (currIdx == SelectedNodeIdx)
+        stack->capacity = (stack->capacity > 0) ? stack->capacity * 2 : TRAVERSAL_STACK_INITIAL_SIZE;
+        entries = realloc(stack->entries, sizeof(int) * (size_t) stack->width * (size_t) stack->capacity);
+        if (!entries)
         {
-            // Save values and don't draw yet.
-            memcpy(&SelectedBBVec[0], &nodeBB[0], sizeof(float) * 6);
-            SelectedSplitPosition = splitPos;
-            SelectedSplitAxis = splitAxis;
+            printf("ERROR: Unable to grow the traversal stack to %i entries.\n\n", stack->capacity);
+            exit(-1);
         }
-        else
-            DrawBoundaryBox(nodeBB, splitAxis, splitPos, currIdx);
-        
-        // Modify boundary box before passing onto node:
-        memcpy(&newBB[0], &nodeBB[0], sizeof(float) * 6);
-        newBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] = splitPos - newBB[TREE_BOUNDING_BOX_LOCATION_X + splitAxis];
-        
-        // Pass onto the first child:
-        _childDrawBoxes(TreeMatrix[currIdx][TREE_MATRIX_LEFT_NODE], newBB);
-        
-        // Modify boundary box before passing onto node:
-        newBB[TREE_BOUNDING_BOX_LOCATION_X + splitAxis] = splitPos;
-        newBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] = nodeBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] - newBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis];
-        
-        // Pass onto the second child:
-        _childDrawBoxes(TreeMatrix[currIdx][TREE_MATRIX_RIGHT_NODE], newBB);
+        stack->entries = entries;
     }
-    else
-        // Don't process leaf nodes
-        return;
+    
+    return &stack->entries[(size_t) stack->width * (size_t) stack->size++];
 }
 
-// Draws a square that's centred at (x, y)
-void DrawSquareNode(float x, float y, int nodeIdx)
+// Pops the top entry off the stack. Returns 0 when the stack is empty.
+int *popStack(TraversalStack *stack)
 {
-    float xmin, ymin, xmax, ymax;
-    
-    // Define corners of square
-    xmin = x - NODE_DRAW_SQUARE_SIZE / 2.0;
-    xmax = xmin + NODE_DRAW_SQUARE_SIZE;
-    ymin = y - NODE_DRAW_SQUARE_SIZE / 2.0;
-    ymax = ymin + NODE_DRAW_SQUARE_SIZE;
-    
-    // Set the tree window
-    // glutSetWindow(treeSubWindow);
-    
-    // Begin defining quadrilateral coordinates
-    if (nodeIdx == SelectedNodeIdx)
-        glColor3f(NODE_DRAW_SQUARE_SELECTED_COLOUR_R, NODE_DRAW_SQUARE_SELECTED_COLOUR_G, NODE_DRAW_SQUARE_SELECTED_COLOUR_B);
-    else
-        glColor3f(NODE_DRAW_SQUARE_COLOUR_R, NODE_DRAW_SQUARE_COLOUR_G, NODE_DRAW_SQUARE_COLOUR_B);
-    glPushMatrix();
-    glBegin(GL_QUADS);
-        glVertex2f(xmin, ymin);
-        glVertex2f(xmin, ymax);
-        glVertex2f(xmax, ymax);
-        glVertex2f(xmax, ymin);
-    glEnd();
-    glPopMatrix();
+    if (stack->size == 0)
+        return 0;
+    return &stack->entries[(size_t) stack->width * (size_t) --stack->size];
 }
 
-// Draws a line from a to b
-void DrawLinesNode(float startx, float starty, float endx, float endy)
+void freeStack(TraversalStack *stack)
 {
-    // Set the tree window
-    // glutSetWindow(treeSubWindow);
-    
-    // Begin defining line coordinates
-    glColor3f(NODE_DRAW_LINE_COLOUR_R, NODE_DRAW_LINE_COLOUR_G, NODE_DRAW_LINE_COLOUR_B);
-    glPushMatrix();
-    glBegin(GL_LINES);
-        glVertex2f(startx, starty);
-        glVertex2f(endx, endy);
-    glEnd();
-    glPopMatrix();
-    
+    free(stack->entries);
+    initialiseStack(stack, stack->width);
 }
 
-// Function to draw the tree
-void DrawTree(void)
+// Works out the bounds of every node in the tree. Each node's bounds are filled in before
+// it's visited, so children are worked out from their parent's entry.
+void computeNodeBounds(void)
 {
-    int n;
+    float splitPos, *nodeBB, *newBB;
+    int n, nodeIdx, splitAxis, leftIdx, rightIdx;
+    TraversalStack stack;
+    
+    free(NodeBounds);
+    NodeBounds = malloc(sizeof(float) * TREE_BOUNDING_BOX_ARRAY_SIZE * (size_t) noTreeMatrixEntries);
+    if (!NodeBounds)
+    {
+        printf("ERROR: Unable to allocate the node bounds for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    // Transform the main scene bounding box variable from fixed point to floating point.
+    for (n = 0; n < 6; n++)
+        NodeBounds[0][n] = (float)SceneBoundingBox[n] / 65536.0;
     
-    // Set the tree window
-    // glutSetWindow(treeSubWindow);
+    initialiseStack(&stack, 1);
+    *pushStack(&stack) = 0;
     
-    // Initialise current progress vector
-    for (n = 0; n < MAX_TREE_DEPTH + 1; n++)
-        TreeDepthCurrentProgress[n] = 0;
+    while (stack.size > 0)
+    {
+        nodeIdx = *popStack(&stack);
+        
+        // Leaf nodes have no children to pass bounds on to:
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+            continue;
+        
+        // Extract and convert the split position and axis:
+        splitPos = (float) TreeMatrix[nodeIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0;
+        splitAxis = TreeMatrix[nodeIdx][TREE_MATRIX_AXIS_INDEX];
+        leftIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+        rightIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+        nodeBB = NodeBounds[nodeIdx];
+        
+        // The first child stops at the split:
+        newBB = NodeBounds[leftIdx];
+        memcpy(newBB, nodeBB, sizeof(float) * 6);
+        newBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] = splitPos - newBB[TREE_BOUNDING_BOX_LOCATION_X + splitAxis];
+        
+        // The second child starts from it:
+        newBB = NodeBounds[rightIdx];
+        memcpy(newBB, nodeBB, sizeof(float) * 6);
+        newBB[TREE_BOUNDING_BOX_LOCATION_X + splitAxis] = splitPos;
+        newBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] = nodeBB[TREE_BOUNDING_BOX_SIZE_X + splitAxis] - NodeBounds[leftIdx][TREE_BOUNDING_BOX_SIZE_X + splitAxis];
+        
+        *pushStack(&stack) = rightIdx;
+        *pushStack(&stack) = leftIdx;
+    }
     
-    // Call the child thread
-    _childDrawTree(0, 0);
+    freeStack(&stack);
 }
 
-// Child draw tree process
-void _childDrawTree(int currIdx, int depth)
+// Works out the surface area of a box.
+float nodeSurfaceArea(float bbvec[6])
 {
-    float posx, parentposx;
-    
-    TreeDepthCurrentProgress[depth]++;
+    return 2.0 * (bbvec[TREE_BOUNDING_BOX_SIZE_X] * bbvec[TREE_BOUNDING_BOX_SIZE_Y] + bbvec[TREE_BOUNDING_BOX_SIZE_Y] * bbvec[TREE_BOUNDING_BOX_SIZE_Z] + bbvec[TREE_BOUNDING_BOX_SIZE_Z] * bbvec[TREE_BOUNDING_BOX_SIZE_X]);
+}
+
+// Works out the expected cost of a ray entering each node using the surface area heuristic.
+// A leaf costs the intersection cost for each of its primitives. A junction costs one
+// traversal step plus the cost of each child weighted by the chance that a ray passing
+// through the node also passes through that child. The root's cost is that of the tree.
+// This needs the node bounds and the node counter.
+void computeNodeCosts(void)
+{
+    float area;
+    int nodeIdx, leftIdx, rightIdx, *entry;
+    TraversalStack stack;
     
-    if (TreeMatrix[currIdx][TREE_MATRIX_LEAF_NODE] < 0)
+    free(NodeCosts);
+    NodeCosts = malloc(sizeof(float) * (size_t) noTreeMatrixEntries);
+    if (!NodeCosts)
     {
-        // Draw child nodes:
-        _childDrawTree(TreeMatrix[currIdx][TREE_MATRIX_LEFT_NODE], depth + 1);
-        _childDrawTree(TreeMatrix[currIdx][TREE_MATRIX_RIGHT_NODE], depth + 1);
+        printf("ERROR: Unable to allocate the node costs for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
     }
     
-    // Compute the new x location
-    posx = (float) TreeDepthCounter[depth];
-    posx = TreeDepthMaxCount*NODE_DRAW_SQUARE_SIZE * ((float) TreeDepthCurrentProgress[depth] * 2.0 - 1.0) / posx;
-    // Compute the old x location:
-    if (depth > 0)
+    initialiseStack(&stack, 2);
+    entry = pushStack(&stack);
+    entry[0] = 0;
+    entry[1] = 0;
+    
+    while ((entry = popStack(&stack)))
     {
-        parentposx = (float) TreeDepthCounter[depth - 1];
-        parentposx = TreeDepthMaxCount*NODE_DRAW_SQUARE_SIZE * ((float) TreeDepthCurrentProgress[depth - 1] * 2.0 - 1.0) / parentposx;
-        // Draw line back to the parent
-        DrawLinesNode(parentposx, -NODE_DRAW_SQUARE_SIZE * 2.0 * ((float) depth - 1), posx, -NODE_DRAW_SQUARE_SIZE * 2.0 * (float) depth);
+        nodeIdx = entry[0];
+        
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            NodeCosts[nodeIdx] = SAHIntersectionCost * (float) TreeNodeCounter[nodeIdx];
+        }
+        else if (entry[1])
+        {
+            // Second visit, so both children are done:
+            leftIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            rightIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            area = nodeSurfaceArea(NodeBounds[nodeIdx]);
+            
+            // A flat node gives no way of telling the children apart, so both are always visited:
+            if (area > 0.0)
+                NodeCosts[nodeIdx] = SAHTraversalCost + (nodeSurfaceArea(NodeBounds[leftIdx]) * NodeCosts[leftIdx] + nodeSurfaceArea(NodeBounds[rightIdx]) * NodeCosts[rightIdx]) / area;
+            else
+                NodeCosts[nodeIdx] = SAHTraversalCost + NodeCosts[leftIdx] + NodeCosts[rightIdx];
+        }
+        else
+        {
+            // Come back to this node after the children:
+            entry = pushStack(&stack);
+            entry[0] = nodeIdx;
+            entry[1] = 1;
+            entry = pushStack(&stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            entry[1] = 0;
+            entry = pushStack(&stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            entry[1] = 0;
+        }
     }
-    // Finally, draw the block:
-    DrawSquareNode(posx, -NODE_DRAW_SQUARE_SIZE * 2.0 * (float) depth, currIdx);
+    
+    freeStack(&stack);
 }
 
-// Function to initialise the tree depth counter:
-void initialiseTreeDepthCounter(void)
+// Builds the camera vector for the ray caster from the scene view's camera.
+void setupCamera(void)
 {
-    int n;
-    for (n = 0; n < MAX_TREE_DEPTH; n++)
-        TreeDepthCounter[n] = 0;
+    float length, tanHalfFoV, *view, *up, *horizontal, *vertical;
+    
+    view = &Camera[CameraView];
+    up = &Camera[CameraUp];
+    horizontal = &Camera[CameraHorizontal];
+    vertical = &Camera[CameraVertical];
+    
+    Camera[CameraLocation + 0] = x;
+    Camera[CameraLocation + 1] = y;
+    Camera[CameraLocation + 2] = z;
+    
+    length = sqrtf(lx * lx + ly * ly + lz * lz);
+    view[0] = lx / length;
+    view[1] = ly / length;
+    view[2] = lz / length;
+    
+    // The scene view always keeps y up:
+    up[0] = 0.0;
+    up[1] = 1.0;
+    up[2] = 0.0;
+    
+    // Horizontal is view x up and vertical is horizontal x view:
+    horizontal[0] = view[1] * up[2] - view[2] * up[1];
+    horizontal[1] = view[2] * up[0] - view[0] * up[2];
+    horizontal[2] = view[0] * up[1] - view[1] * up[0];
+    length = sqrtf(horizontal[0] * horizontal[0] + horizontal[1] * horizontal[1] + horizontal[2] * horizontal[2]);
+    horizontal[0] /= length;
+    horizontal[1] /= length;
+    horizontal[2] /= length;
+    vertical[0] = horizontal[1] * view[2] - horizontal[2] * view[1];
+    vertical[1] = horizontal[2] * view[0] - horizontal[0] * view[2];
+    vertical[2] = horizontal[0] * view[1] - horizontal[1] * view[0];
+    
+    // The field of view is vertical. Precompute the steps between pixels:
+    tanHalfFoV = tan(RayCastFoV * FP_PI / 360.0);
+    Camera[CameraFoV] = RayCastFoV;
+    Camera[CameraAR] = (float) IMAGE_WIDTH / (float) IMAGE_HEIGHT;
+    Camera[CameraHeight] = IMAGE_HEIGHT;
+    Camera[CameraWidth] = IMAGE_WIDTH;
+    Camera[CameraFoVAR] = tanHalfFoV * Camera[CameraAR];
+    Camera[CameraDFoVARDW] = 2.0 * Camera[CameraFoVAR] / (float) IMAGE_WIDTH;
+    Camera[CameraDFoVDH] = 2.0 * tanHalfFoV / (float) IMAGE_HEIGHT;
 }
 
-void populateTreeDepthCounter(void)
+// Gets hit data ready for a ray that hasn't hit anything yet.
+void initialiseHitData(float hitData[HIT_DATA_SIZE])
 {
-    // Call the child thread:
-    _childTreeDepthCounter(0, 0);
+    memset(hitData, 0, sizeof(float) * HIT_DATA_SIZE);
+    hitData[HitDataDistance] = FURTHEST_RAY;
+    hitData[HitDataTriangleIndex] = -1.0;
+    hitData[HitDataMaterialIndex] = -1.0;
 }
 
-void _childTreeDepthCounter(int nodeIdx, int depth)
+// Fills in the rest of the hit data once the closest hit is known: where the hit is, the
+// triangle's normal and material, and the ray itself. The normal direction is 1 when the ray
+// meets the front of the triangle and -1 when it meets the back.
+void completeHitData(const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE])
 {
-    int n;
+    int n, triangleIdx = (int) hitData[HitDataTriangleIndex];
+    float facing = 0.0;
     
-    // Increment the counter
-    TreeDepthCounter[depth]++;
-    if (TreeDepthCounter[depth] > TreeDepthMaxCount)
-        TreeDepthMaxCount = TreeDepthCounter[depth];
+    for (n = 0; n < 3; n++)
+    {
+        hitData[HitDataRaySource + n] = ray[RaySourcex + n];
+        hitData[HitDataRayDirection + n] = ray[RayDirectionx + n];
+    }
     
-    // And assign the tree depth to this index:
-    TreeDepthAssignment[nodeIdx] = depth;
+    if (triangleIdx < 0)
+        return;
     
-    // Check if this branch is a leaf node. If not, call on children
-    if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+    for (n = 0; n < 3; n++)
     {
-        // First try the left:
-        _childTreeDepthCounter(TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE], depth + 1);
-        // Then try the right:
-        _childTreeDepthCounter(TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE], depth + 1);
+        hitData[HitDataHitLocation + n] = ray[RaySourcex + n] + hitData[HitDataDistance] * ray[RayDirectionx + n];
+        hitData[HitDataHitNormal + n] = ObjectNormals[triangleIdx][NormalX + n];
+        facing += ObjectNormals[triangleIdx][NormalX + n] * ray[RayDirectionx + n];
     }
+    hitData[HitDataMaterialIndex] = ObjectMaterials[triangleIdx];
+    hitData[HitDataNormDir] = (facing <= 0.0) ? 1.0 : -1.0;
 }
 
-void initialiseTreeNodeCounter(void)
-{
-    int n;
-    for (n = 0; n < MAX_BOUNDING_BOXES; n++)
-        TreeNodeCounter[n] = 0;
-}
-
-void populateTreeNodeCounter(void)
+// Tests a ray against a triangle with the Wald projection coefficients from the scenery file.
+// Returns 1 and updates the distance, triangle index and barycentric coordinates in hitData if
+// the triangle is hit closer than the hit already there.
+int intersectTriangle(int triangleIdx, const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE])
 {
-    _childTreeNodeCounter(0);
+    static const int modulo[5] = {0, 1, 2, 0, 1};
+    const float *intersection = ObjectIntersections[triangleIdx];
+    const float *position = ObjectPositions[triangleIdx];
+    float denominator, t, hu, hv, beta, gamma;
+    int k, ku, kv;
+    
+    k = (int) intersection[IntersectionDominantAxisIdx];
+    if (k < 0 || k > 2)
+        return 0;
+    ku = modulo[k + 1];
+    kv = modulo[k + 2];
+    
+    // Distance to the plane of the triangle:
+    denominator = ray[RayDirectionx + k] + intersection[IntersectionNUDom] * ray[RayDirectionx + ku] + intersection[IntersectionNVDom] * ray[RayDirectionx + kv];
+    if (denominator == 0.0)
+        return 0;
+    t = (intersection[IntersectionNDDom] - ray[RaySourcex + k] - intersection[IntersectionNUDom] * ray[RaySourcex + ku] - intersection[IntersectionNVDom] * ray[RaySourcex + kv]) / denominator;
+    if (!(t > RAYCAST_EPSILON && t < hitData[HitDataDistance]))
+        return 0;
+    
+    // Then check the hit point lies within the triangle, projected onto the other two axes:
+    hu = ray[RaySourcex + ku] + t * ray[RayDirectionx + ku] - position[PositionAx + ku];
+    hv = ray[RaySourcex + kv] + t * ray[RayDirectionx + kv] - position[PositionAx + kv];
+    beta = hv * intersection[IntersectionBUDom] + hu * intersection[IntersectionBVDom];
+    if (beta < 0.0)
+        return 0;
+    gamma = hu * intersection[IntersectionCUDom] + hv * intersection[IntersectionCVDom];
+    if (gamma < 0.0 || beta + gamma > 1.0)
+        return 0;
+    
+    hitData[HitDataDistance] = t;
+    hitData[HitDataTriangleIndex] = triangleIdx;
+    hitData[HitDataMu] = beta;
+    hitData[HitDataMv] = gamma;
+    return 1;
 }
 
-int _childTreeNodeCounter(int nodeIdx)
+// Tests a ray against every triangle in a leaf's primitive list, four at a time, keeping the
+// closest hit in hitData as intersectTriangle does. Returns the number of triangles tested.
+int intersectLeaf(const int *primitives, int noPrimitives, const float ray[RAY_VECTOR_SIZE], float hitData[HIT_DATA_SIZE])
 {
-    int n, count = 0, idx;
+    int triangleIdx, i = 0, noTests = 0;
+#ifdef __SSE2__
+    static const int modulo[5] = {0, 1, 2, 0, 1};
+    float coefficients[INTERSECTION_SIZE + 2][RAY_PACKET_SIZE], rayComponents[6][RAY_PACKET_SIZE], lanes[3][RAY_PACKET_SIZE];
+    const float *intersection, *position;
+    __m128 t, hu, hv, beta, gamma, valid, zero, one;
+    int n, m, k, ku, kv, mask, noLanes, triangles[RAY_PACKET_SIZE];
+    
+    zero = _mm_setzero_ps();
+    one = _mm_set1_ps(1.0f);
     
-    if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+    while (i < noPrimitives)
     {
-        // Begin recursive search
-        idx = TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE];
+        // Gather the next four triangles and the parts of the ray each one projects onto:
+        noLanes = 0;
+        while (i < noPrimitives && noLanes < RAY_PACKET_SIZE)
+        {
+            triangleIdx = primitives[i++];
+            if (triangleIdx < 0 || triangleIdx >= noTriangles)
+                continue;
+            
+            intersection = ObjectIntersections[triangleIdx];
+            position = ObjectPositions[triangleIdx];
+            k = (int) intersection[IntersectionDominantAxisIdx];
+            noTests++;
+            if (k < 0 || k > 2)
+                continue;
+            ku = modulo[k + 1];
+            kv = modulo[k + 2];
+            
+            triangles[noLanes] = triangleIdx;
+            for (m = IntersectionNUDom; m < INTERSECTION_SIZE; m++)
+                coefficients[m][noLanes] = intersection[m];
+            coefficients[INTERSECTION_SIZE + 0][noLanes] = position[PositionAx + ku];
+            coefficients[INTERSECTION_SIZE + 1][noLanes] = position[PositionAx + kv];
+            rayComponents[0][noLanes] = ray[RaySourcex + k];
+            rayComponents[1][noLanes] = ray[RaySourcex + ku];
+            rayComponents[2][noLanes] = ray[RaySourcex + kv];
+            rayComponents[3][noLanes] = ray[RayDirectionx + k];
+            rayComponents[4][noLanes] = ray[RayDirectionx + ku];
+            rayComponents[5][noLanes] = ray[RayDirectionx + kv];
+            noLanes++;
+        }
+        if (noLanes == 0)
+            break;
         
-        while (idx >= 0)
+        // Unused lanes get a ray that can't hit anything:
+        for (n = noLanes; n < RAY_PACKET_SIZE; n++)
         {
-            count++;
-            idx = NodeList[idx][NODE_LIST_NEXT_INDEX];
+            for (m = IntersectionNUDom; m < INTERSECTION_SIZE + 2; m++)
+                coefficients[m][n] = 0.0;
+            for (m = 0; m < 6; m++)
+                rayComponents[m][n] = 0.0;
+        }
+        
+        // The same test as intersectTriangle, for four triangles at once:
+        t = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(coefficients[IntersectionNDDom]), _mm_loadu_ps(rayComponents[0])), _mm_mul_ps(_mm_loadu_ps(coefficients[IntersectionNUDom]), _mm_loadu_ps(rayComponents[1]))), _mm_mul_ps(_mm_loadu_ps(coefficients[IntersectionNVDom]), _mm_loadu_ps(rayComponents[2])));
+        t = _mm_div_ps(t, _mm_add_ps(_mm_loadu_ps(rayComponents[3]), _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coefficients[IntersectionNUDom]), _mm_loadu_ps(rayComponents[4])), _mm_mul_ps(_mm_loadu_ps(coefficients[IntersectionNVDom]), _mm_loadu_ps(rayComponents[5])))));
+        valid = _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(RAYCAST_EPSILON)), _mm_cmplt_ps(t, _mm_set1_ps(hitData[HitDataDistance])));
+        if (!_mm_movemask_ps(valid))
+            continue;
+        
+        hu = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(rayComponents[1]), _mm_mul_ps(t, _mm_loadu_ps(rayComponents[4]))), _mm_loadu_ps(coefficients[INTERSECTION_SIZE + 0]));
+        hv = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(rayComponents[2]), _mm_mul_ps(t, _mm_loadu_ps(rayComponents[5]))), _mm_loadu_ps(coefficients[INTERSECTION_SIZE + 1]));
+        beta = _mm_add_ps(_mm_mul_ps(hv, _mm_loadu_ps(coefficients[IntersectionBUDom])), _mm_mul_ps(hu, _mm_loadu_ps(coefficients[IntersectionBVDom])));
+        gamma = _mm_add_ps(_mm_mul_ps(hu, _mm_loadu_ps(coefficients[IntersectionCUDom])), _mm_mul_ps(hv, _mm_loadu_ps(coefficients[IntersectionCVDom])));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(beta, zero), _mm_cmpge_ps(gamma, zero)));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(beta, gamma), one));
+        
+        mask = _mm_movemask_ps(valid);
+        if (!mask)
+            continue;
+        
+        // Keep the closest of the lanes that hit:
+        _mm_storeu_ps(lanes[0], t);
+        _mm_storeu_ps(lanes[1], beta);
+        _mm_storeu_ps(lanes[2], gamma);
+        for (n = 0; n < noLanes; n++)
+        {
+            if ((mask & (1 << n)) && lanes[0][n] < hitData[HitDataDistance])
+            {
+                hitData[HitDataDistance] = lanes[0][n];
+                hitData[HitDataTriangleIndex] = triangles[n];
+                hitData[HitDataMu] = lanes[1][n];
+                hitData[HitDataMv] = lanes[2][n];
+            }
         }
-        TreeNodeCounter[nodeIdx] = count;
-        return count;
     }
-    
-    count = _childTreeNodeCounter(TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE]);
-    count += _childTreeNodeCounter(TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE]);
-    
-    TreeNodeCounter[nodeIdx] = count;
-    
-    return count;
-}
-
-// Main window display function
-void mainWindowRenderer(void)
-{
-    if (deltaMoveFB || deltaMoveLR || deltaMoveUD)
+#else
+    for (i = 0; i < noPrimitives; i++)
     {
-        computeScenePosition();
-        glutSetWindow(mainWindow);
-        glutPostRedisplay();
+        triangleIdx = primitives[i];
+        if (triangleIdx < 0 || triangleIdx >= noTriangles)
+            continue;
+        noTests++;
+        intersectTriangle(triangleIdx, ray, hitData);
     }
+#endif
     
-    glutSetWindow(mainWindow);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glutSwapBuffers();
-    
-    // Call child display renderers:
-    treeSubWindowRenderer();
-    sceneSubWindowRenderer();
-}
-
-// Main window reshape function
-void reshapeFunc(int newWidth, int newHeight)
-{
-    // Always force the size to be set to defaults
-    glutReshapeWindow(SCREEN_WIDTH, SCREEN_HEIGHT);
-    glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
-    glMatrixMode(GL_PROJECTION);  
-    glLoadIdentity();  
-    gluOrtho2D(0, SCREEN_WIDTH, SCREEN_HEIGHT, 0);  
-    glMatrixMode(GL_MODELVIEW);  
-    glLoadIdentity();  
+    return noTests;
 }
 
-// Main window idle function
-void idleFunc(void)
+#ifdef __SSE2__
+// Tests a packet of rays against one triangle. Rays outside the active mask are left alone.
+// The closest hit of each ray is kept in distance, hitIdx, mu and mv as intersectTriangle does.
+void intersectTrianglePacket(int triangleIdx, const __m128 origin[3], const __m128 direction[3], __m128 active, __m128 *distance, __m128i *hitIdx, __m128 *mu, __m128 *mv)
 {
-    glutPostRedisplay();
+    static const int modulo[5] = {0, 1, 2, 0, 1};
+    const float *intersection = ObjectIntersections[triangleIdx];
+    const float *position = ObjectPositions[triangleIdx];
+    __m128 t, hu, hv, beta, gamma, valid, zero;
+    int k, ku, kv;
+    
+    k = (int) intersection[IntersectionDominantAxisIdx];
+    if (k < 0 || k > 2)
+        return;
+    ku = modulo[k + 1];
+    kv = modulo[k + 2];
+    zero = _mm_setzero_ps();
+    
+    t = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(intersection[IntersectionNDDom]), origin[k]), _mm_mul_ps(_mm_set1_ps(intersection[IntersectionNUDom]), origin[ku])), _mm_mul_ps(_mm_set1_ps(intersection[IntersectionNVDom]), origin[kv]));
+    t = _mm_div_ps(t, _mm_add_ps(direction[k], _mm_add_ps(_mm_mul_ps(_mm_set1_ps(intersection[IntersectionNUDom]), direction[ku]), _mm_mul_ps(_mm_set1_ps(intersection[IntersectionNVDom]), direction[kv]))));
+    valid = _mm_and_ps(active, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(RAYCAST_EPSILON)), _mm_cmplt_ps(t, *distance)));
+    if (!_mm_movemask_ps(valid))
+        return;
+    
+    hu = _mm_sub_ps(_mm_add_ps(origin[ku], _mm_mul_ps(t, direction[ku])), _mm_set1_ps(position[PositionAx + ku]));
+    hv = _mm_sub_ps(_mm_add_ps(origin[kv], _mm_mul_ps(t, direction[kv])), _mm_set1_ps(position[PositionAx + kv]));
+    beta = _mm_add_ps(_mm_mul_ps(hv, _mm_set1_ps(intersection[IntersectionBUDom])), _mm_mul_ps(hu, _mm_set1_ps(intersection[IntersectionBVDom])));
+    gamma = _mm_add_ps(_mm_mul_ps(hu, _mm_set1_ps(intersection[IntersectionCUDom])), _mm_mul_ps(hv, _mm_set1_ps(intersection[IntersectionCVDom])));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(beta, zero), _mm_cmpge_ps(gamma, zero)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(beta, gamma), _mm_set1_ps(1.0f)));
+    
+    *distance = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, *distance));
+    *mu = _mm_or_ps(_mm_and_ps(valid, beta), _mm_andnot_ps(valid, *mu));
+    *mv = _mm_or_ps(_mm_and_ps(valid, gamma), _mm_andnot_ps(valid, *mv));
+    *hitIdx = _mm_or_si128(_mm_and_si128(_mm_castps_si128(valid), _mm_set1_epi32(triangleIdx)), _mm_andnot_si128(_mm_castps_si128(valid), *hitIdx));
 }
+#endif
 
-// Tree sub window display function
-void treeSubWindowRenderer(void)
+// Follows a ray through the tree front to back until the closest hit is found. Returns the
+// index of the triangle hit, or -1, and fills in hitData. The nodes the ray visits are added to
+// nodeVisits, if it's given, and the ray's work is recorded in stats. If hitLeafIdx is given, it's
+// set to the leaf the closest hit was found in, or -1. The stack needs an entry for every level
+// of the tree.
+int castRay(const float ray[RAY_VECTOR_SIZE], RayStackEntry *stack, unsigned int *nodeVisits, int stats[RAY_STATS_SIZE], float hitData[HIT_DATA_SIZE], int *hitLeafIdx)
 {
-    glutSetWindow(treeSubWindow);
+    float tNear = 0.0, tFar = FURTHEST_RAY, t0, t1, tSplit, inverse, distance, *bounds;
+    int n, nodeIdx, nearIdx, farIdx, axis, stackSize = 0;
     
-    // Clear information from last draw:
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    // Switch to drawing mode
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
+    initialiseHitData(hitData);
+    if (hitLeafIdx)
+        *hitLeafIdx = -1;
+    stats[RayStatsNodes] = 0;
+    stats[RayStatsLeaves] = 0;
+    stats[RayStatsTriangles] = 0;
     
-    gluOrtho2D(-10, (SCREEN_WIDTH / 3 - BORDER_SIZE / 2) - 10, -(SCREEN_HEIGHT - 2 * BORDER_SIZE) + 10, 10);
-    // gluPerspective(90.0, 0.625, 3.0, 200.0);
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    // gluLookAt(40, -40, 70, 40, -40, 0, 0, 1, 0);
-    DrawTree();
-    DisplayNodeInfo();
-    glPopMatrix();
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
-    // Finally, swap buffers:
-    glutSwapBuffers();
+    // Clip the ray to the scene box first:
+    bounds = NodeBounds[0];
+    for (n = 0; n < 3; n++)
+    {
+        if (ray[RayDirectionx + n] == 0.0)
+        {
+            if (ray[RaySourcex + n] < bounds[TREE_BOUNDING_BOX_LOCATION_X + n] || ray[RaySourcex + n] > bounds[TREE_BOUNDING_BOX_LOCATION_X + n] + bounds[TREE_BOUNDING_BOX_SIZE_X + n])
+            {
+                completeHitData(ray, hitData);
+                return -1;
+            }
+            continue;
+        }
+        inverse = 1.0 / ray[RayDirectionx + n];
+        t0 = (bounds[TREE_BOUNDING_BOX_LOCATION_X + n] - ray[RaySourcex + n]) * inverse;
+        t1 = (bounds[TREE_BOUNDING_BOX_LOCATION_X + n] + bounds[TREE_BOUNDING_BOX_SIZE_X + n] - ray[RaySourcex + n]) * inverse;
+        if (t0 > t1)
+        {
+            tSplit = t0;
+            t0 = t1;
+            t1 = tSplit;
+        }
+        if (t0 > tNear)
+            tNear = t0;
+        if (t1 < tFar)
+            tFar = t1;
+    }
+    if (tNear > tFar)
+    {
+        completeHitData(ray, hitData);
+        return -1;
+    }
+    
+    nodeIdx = 0;
+    while (1)
+    {
+        // Walk down to a leaf, leaving the far side of each split on the stack if it's needed:
+        while (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+        {
+            if (nodeVisits)
+                nodeVisits[nodeIdx]++;
+            stats[RayStatsNodes]++;
+            
+            axis = TreeMatrix[nodeIdx][TREE_MATRIX_AXIS_INDEX];
+            tSplit = (float) TreeMatrix[nodeIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0 - ray[RaySourcex + axis];
+            
+            // The left child lies below the split:
+            if (tSplit > 0.0 || (tSplit == 0.0 && ray[RayDirectionx + axis] <= 0.0))
+            {
+                nearIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+                farIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            }
+            else
+            {
+                nearIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+                farIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            }
+            
+            if (ray[RayDirectionx + axis] == 0.0)
+            {
+                nodeIdx = nearIdx;
+                continue;
+            }
+            tSplit /= ray[RayDirectionx + axis];
+            
+            if (tSplit > tFar || tSplit <= 0.0)
+            {
+                nodeIdx = nearIdx;
+            }
+            else if (tSplit < tNear)
+            {
+                nodeIdx = farIdx;
+            }
+            else
+            {
+                stack[stackSize].nodeIdx = farIdx;
+                stack[stackSize].tNear = tSplit;
+                stack[stackSize].tFar = tFar;
+                stackSize++;
+                nodeIdx = nearIdx;
+                tFar = tSplit;
+            }
+        }
+        
+        // Then test everything in the leaf, noting it if it holds the closest hit so far:
+        if (nodeVisits)
+            nodeVisits[nodeIdx]++;
+        stats[RayStatsNodes]++;
+        stats[RayStatsLeaves]++;
+        
+        distance = hitData[HitDataDistance];
+        stats[RayStatsTriangles] += intersectLeaf(&LeafPrimitives[LeafPrimitiveOffsets[nodeIdx]], countLeafPrimitives(nodeIdx), ray, hitData);
+        if (hitLeafIdx && hitData[HitDataDistance] < distance)
+            *hitLeafIdx = nodeIdx;
+        
+        // A hit within this leaf can't be beaten by anything further along:
+        if (hitData[HitDataDistance] <= tFar || stackSize == 0)
+        {
+            completeHitData(ray, hitData);
+            return (int) hitData[HitDataTriangleIndex];
+        }
+        
+        stackSize--;
+        nodeIdx = stack[stackSize].nodeIdx;
+        tNear = stack[stackSize].tNear;
+        tFar = stack[stackSize].tFar;
+    }
 }
 
-// Scene sub window display function
-void sceneSubWindowRenderer(void)
+// Follows four rays through the tree together. The packet descends as one, only splitting off
+// the far side of a node when some of its rays need it, and each ray drops out once its
+// closest hit is found. The rays must head the same way along each axis, otherwise they're
+// cast one at a time. Results are as for castRay.
+void castRayPacket(float rays[RAY_PACKET_SIZE][RAY_VECTOR_SIZE], RayPacketStackEntry *packetStack, RayStackEntry *stack, unsigned int *nodeVisits, int *stats[RAY_PACKET_SIZE], float hitData[RAY_PACKET_SIZE][HIT_DATA_SIZE])
 {
-    glutSetWindow(sceneSubWindow);
+    int n;
+#ifdef __SSE2__
+    __m128 origin[3], direction[3], inverse[3], tNear, tFar, t0, t1, tSplit, distance, mu, mv, active, done;
+    __m128 zero, one, tiny, signBit, isZero;
+    __m128i hitIdx;
+    float lanes[3][RAY_PACKET_SIZE];
+    int hits[RAY_PACKET_SIZE];
+    const float *bounds;
+    int dirNegative[3], m, mask, nodeIdx, nearIdx, farIdx, axis, idx, triangleIdx, stackSize = 0;
     
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    // Switch to drawing mode
+    zero = _mm_setzero_ps();
+    one = _mm_set1_ps(1.0f);
+    tiny = _mm_set1_ps(1e-30f);
+    signBit = _mm_set1_ps(-0.0f);
+    
+    for (m = 0; m < 3; m++)
+    {
+        origin[m] = _mm_set_ps(rays[3][RaySourcex + m], rays[2][RaySourcex + m], rays[1][RaySourcex + m], rays[0][RaySourcex + m]);
+        direction[m] = _mm_set_ps(rays[3][RayDirectionx + m], rays[2][RayDirectionx + m], rays[1][RayDirectionx + m], rays[0][RayDirectionx + m]);
+        
+        mask = _mm_movemask_ps(direction[m]);
+        if (mask != 0 && mask != 0xF)
+            break;
+        dirNegative[m] = (mask != 0);
+        
+        // Stand in a tiny step for a zero direction so that no infinities meet zeroes:
+        isZero = _mm_cmpeq_ps(direction[m], zero);
+        inverse[m] = _mm_div_ps(one, _mm_or_ps(_mm_andnot_ps(isZero, direction[m]), _mm_and_ps(isZero, _mm_or_ps(tiny, _mm_and_ps(direction[m], signBit)))));
+    }
+    
+    if (m == 3)
+    {
+        for (n = 0; n < RAY_PACKET_SIZE; n++)
+        {
+            stats[n][RayStatsNodes] = 0;
+            stats[n][RayStatsLeaves] = 0;
+            stats[n][RayStatsTriangles] = 0;
+        }
+        
+        // Clip the rays to the scene box first:
+        bounds = NodeBounds[0];
+        tNear = zero;
+        tFar = _mm_set1_ps(FURTHEST_RAY);
+        for (m = 0; m < 3; m++)
+        {
+            t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[TREE_BOUNDING_BOX_LOCATION_X + m]), origin[m]), inverse[m]);
+            t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[TREE_BOUNDING_BOX_LOCATION_X + m] + bounds[TREE_BOUNDING_BOX_SIZE_X + m]), origin[m]), inverse[m]);
+            tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+            tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+        }
+        
+        distance = _mm_set1_ps(FURTHEST_RAY);
+        mu = zero;
+        mv = zero;
+        hitIdx = _mm_set1_epi32(-1);
+        done = _mm_cmpgt_ps(tNear, tFar);
+        nodeIdx = 0;
+        
+        while (_mm_movemask_ps(done) != 0xF)
+        {
+            // Walk down to a leaf, leaving the far side of each split on the stack if any ray needs it:
+            while (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+            {
+                active = _mm_andnot_ps(done, _mm_cmple_ps(tNear, tFar));
+                mask = _mm_movemask_ps(active);
+                for (n = 0; n < RAY_PACKET_SIZE; n++)
+                {
+                    if (mask & (1 << n))
+                    {
+                        nodeVisits[nodeIdx]++;
+                        stats[n][RayStatsNodes]++;
+                    }
+                }
+                
+                axis = TreeMatrix[nodeIdx][TREE_MATRIX_AXIS_INDEX];
+                tSplit = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps((float) TreeMatrix[nodeIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0), origin[axis]), inverse[axis]);
+                
+                // Rays heading down the axis meet the right child first:
+                if (dirNegative[axis])
+                {
+                    nearIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+                    farIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+                }
+                else
+                {
+                    nearIdx = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+                    farIdx = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+                }
+                
+                if (!_mm_movemask_ps(_mm_and_ps(active, _mm_cmplt_ps(tSplit, tFar))))
+                {
+                    nodeIdx = nearIdx;
+                }
+                else if (!_mm_movemask_ps(_mm_and_ps(active, _mm_cmpgt_ps(tSplit, tNear))))
+                {
+                    nodeIdx = farIdx;
+                }
+                else
+                {
+                    packetStack[stackSize].nodeIdx = farIdx;
+                    _mm_storeu_ps(packetStack[stackSize].tNear, _mm_max_ps(tSplit, tNear));
+                    _mm_storeu_ps(packetStack[stackSize].tFar, tFar);
+                    stackSize++;
+                    nodeIdx = nearIdx;
+                    tFar = _mm_min_ps(tSplit, tFar);
+                }
+            }
+            
+            // Then test everything in the leaf against the rays still passing through it:
+            active = _mm_andnot_ps(done, _mm_cmple_ps(tNear, tFar));
+            mask = _mm_movemask_ps(active);
+            if (mask)
+            {
+                for (n = 0; n < RAY_PACKET_SIZE; n++)
+                {
+                    if (mask & (1 << n))
+                    {
+                        nodeVisits[nodeIdx]++;
+                        stats[n][RayStatsNodes]++;
+                        stats[n][RayStatsLeaves]++;
+                    }
+                }
+                
+                for (idx = LeafPrimitiveOffsets[nodeIdx]; idx < LeafPrimitiveOffsets[nodeIdx + 1]; idx++)
+                {
+                    triangleIdx = LeafPrimitives[idx];
+                    if (triangleIdx < 0 || triangleIdx >= noTriangles)
+                        continue;
+                    
+                    for (n = 0; n < RAY_PACKET_SIZE; n++)
+                    {
+                        if (mask & (1 << n))
+                            stats[n][RayStatsTriangles]++;
+                    }
+                    intersectTrianglePacket(triangleIdx, origin, direction, active, &distance, &hitIdx, &mu, &mv);
+                }
+                
+                // A hit within this leaf can't be beaten by anything further along:
+                done = _mm_or_ps(done, _mm_and_ps(active, _mm_cmple_ps(distance, tFar)));
+            }
+            
+            if (stackSize == 0)
+                break;
+            stackSize--;
+            nodeIdx = packetStack[stackSize].nodeIdx;
+            tNear = _mm_loadu_ps(packetStack[stackSize].tNear);
+            tFar = _mm_loadu_ps(packetStack[stackSize].tFar);
+        }
+        
+        _mm_storeu_ps(lanes[0], distance);
+        _mm_storeu_ps(lanes[1], mu);
+        _mm_storeu_ps(lanes[2], mv);
+        _mm_storeu_si128((__m128i *) hits, hitIdx);
+        for (n = 0; n < RAY_PACKET_SIZE; n++)
+        {
+            initialiseHitData(hitData[n]);
+            if (hits[n] >= 0)
+            {
+                hitData[n][HitDataDistance] = lanes[0][n];
+                hitData[n][HitDataTriangleIndex] = hits[n];
+                hitData[n][HitDataMu] = lanes[1][n];
+                hitData[n][HitDataMv] = lanes[2][n];
+            }
+            completeHitData(rays[n], hitData[n]);
+        }
+        return;
+    }
+#endif
+    
+    // The rays go different ways, so cast them one at a time:
+    for (n = 0; n < RAY_PACKET_SIZE; n++)
+        castRay(rays[n], stack, nodeVisits, stats[n], hitData[n], NULL);
+}
+
+// Works out the direction of the ray through a pixel.
+void pixelRay(int px, int py, float ray[RAY_VECTOR_SIZE])
+{
+    float horizontalStep, verticalStep;
+    int n;
+    
+    horizontalStep = ((float) px + 0.5) * Camera[CameraDFoVARDW] - Camera[CameraFoVAR];
+    verticalStep = Camera[CameraDFoVDH] * (Camera[CameraHeight] / 2.0 - ((float) py + 0.5));
+    for (n = 0; n < 3; n++)
+    {
+        ray[RaySourcex + n] = Camera[CameraLocation + n];
+        ray[RayDirectionx + n] = Camera[CameraView + n] + horizontalStep * Camera[CameraHorizontal + n] + verticalStep * Camera[CameraVertical + n];
+    }
+}
+
+// Worker thread for the ray caster. Tiles of the image are handed out until there are none
+// left. In packet mode each 2x2 block of pixels is cast as one packet. Node visits are counted
+// locally and added to the shared counts at the end.
+void *_childCastRays(void *arg)
+{
+    RayCaster *caster = (RayCaster *) arg;
+    RayStackEntry *stack;
+    RayPacketStackEntry *packetStack;
+    unsigned int *nodeVisits;
+    float rays[RAY_PACKET_SIZE][RAY_VECTOR_SIZE], hitData[RAY_PACKET_SIZE][HIT_DATA_SIZE];
+    int *stats[RAY_PACKET_SIZE];
+    int n, tile, px, py, startX, startY, pixel;
+    
+    stack = (RayStackEntry *) malloc(sizeof(RayStackEntry) * (size_t) (noTreeDepthLevels + 1));
+    packetStack = (RayPacketStackEntry *) malloc(sizeof(RayPacketStackEntry) * (size_t) (noTreeDepthLevels + 1));
+    nodeVisits = (unsigned int *) calloc(noTreeMatrixEntries, sizeof(unsigned int));
+    if (!stack || !packetStack || !nodeVisits)
+    {
+        free(stack);
+        free(packetStack);
+        free(nodeVisits);
+        return (void *) 0;
+    }
+    
+    while ((tile = __sync_fetch_and_add(&caster->nextTile, 1)) < caster->noTiles)
+    {
+        startX = (tile % caster->tilesAcross) * RAYCAST_TILE_SIZE;
+        startY = (tile / caster->tilesAcross) * RAYCAST_TILE_SIZE;
+        
+        for (py = startY; py < startY + RAYCAST_TILE_SIZE && py < IMAGE_HEIGHT; py += 2)
+        {
+            for (px = startX; px < startX + RAYCAST_TILE_SIZE && px < IMAGE_WIDTH; px += 2)
+            {
+                if (caster->usePackets && px + 1 < IMAGE_WIDTH && py + 1 < IMAGE_HEIGHT)
+                {
+                    for (n = 0; n < RAY_PACKET_SIZE; n++)
+                    {
+                        pixelRay(px + (n & 1), py + (n >> 1), rays[n]);
+                        stats[n] = RayStats[(py + (n >> 1)) * IMAGE_WIDTH + px + (n & 1)];
+                    }
+                    castRayPacket(rays, packetStack, stack, nodeVisits, stats, hitData);
+                }
+                else
+                {
+                    // Edges of the image, or scalar mode, go one ray at a time:
+                    for (n = 0; n < RAY_PACKET_SIZE; n++)
+                    {
+                        if (px + (n & 1) >= IMAGE_WIDTH || py + (n >> 1) >= IMAGE_HEIGHT)
+                            continue;
+                        pixelRay(px + (n & 1), py + (n >> 1), rays[n]);
+                        castRay(rays[n], stack, nodeVisits, RayStats[(py + (n >> 1)) * IMAGE_WIDTH + px + (n & 1)], hitData[n], NULL);
+                    }
+                }
+                
+                if (caster->hits)
+                {
+                    for (n = 0; n < RAY_PACKET_SIZE; n++)
+                    {
+                        pixel = (py + (n >> 1)) * IMAGE_WIDTH + px + (n & 1);
+                        if (px + (n & 1) < IMAGE_WIDTH && py + (n >> 1) < IMAGE_HEIGHT)
+                            caster->hits[pixel] = (int) hitData[n][HitDataTriangleIndex];
+                    }
+                }
+            }
+        }
+    }
+    
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        if (nodeVisits[n])
+            __sync_fetch_and_add(&NodeVisitCounts[n], nodeVisits[n]);
+    }
+    
+    free(stack);
+    free(packetStack);
+    free(nodeVisits);
+    return (void *) 1;
+}
+
+// Casts a ray through every pixel of an IMAGE_WIDTH x IMAGE_HEIGHT image from the scene view's
+// camera, filling in RayStats and NodeVisitCounts. The triangle each ray hits is written to hits
+// if it's given. Returns the time taken in seconds, or a negative value on failure.
+double traceImage(int usePackets, int *hits)
+{
+    RayCaster caster;
+    struct timespec start, end;
+    int noRays = IMAGE_WIDTH * IMAGE_HEIGHT;
+    
+    if (!NodeVisitCounts)
+        NodeVisitCounts = (unsigned int *) malloc(sizeof(unsigned int) * (size_t) noTreeMatrixEntries);
+    if (!RayStats)
+        RayStats = malloc(sizeof(int) * RAY_STATS_SIZE * (size_t) noRays);
+    if (!NodeVisitCounts || !RayStats)
+        return -1.0;
+    memset(NodeVisitCounts, 0, sizeof(unsigned int) * (size_t) noTreeMatrixEntries);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    setupCamera();
+    caster.tilesAcross = (IMAGE_WIDTH + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE;
+    caster.noTiles = caster.tilesAcross * ((IMAGE_HEIGHT + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE);
+    caster.nextTile = 0;
+    caster.usePackets = usePackets;
+    caster.hits = hits;
+    if (!runWorkerThreads(_childCastRays, &caster, caster.noTiles))
+        return -1.0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Works out the cost of a ray entering each node from the work the cast rays actually did,
+// on the same scale as computeNodeCosts. Each leaf visit costs the intersection cost for every
+// primitive tested and each junction visit costs one traversal step. Nodes no ray entered
+// are given no cost.
+void computeMeasuredCosts(void)
+{
+    double *work;
+    int nodeIdx, *entry;
+    TraversalStack stack;
+    
+    free(NodeMeasuredCosts);
+    NodeMeasuredCosts = (float *) malloc(sizeof(float) * (size_t) noTreeMatrixEntries);
+    work = (double *) malloc(sizeof(double) * (size_t) noTreeMatrixEntries);
+    if (!NodeMeasuredCosts || !work)
+    {
+        printf("ERROR: Unable to allocate the measured costs for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    initialiseStack(&stack, 2);
+    entry = pushStack(&stack);
+    entry[0] = 0;
+    entry[1] = 0;
+    
+    while ((entry = popStack(&stack)))
+    {
+        nodeIdx = entry[0];
+        
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            work[nodeIdx] = (double) NodeVisitCounts[nodeIdx] * SAHIntersectionCost * TreeNodeCounter[nodeIdx];
+        }
+        else if (entry[1])
+        {
+            // Second visit, so both children are done:
+            work[nodeIdx] = (double) NodeVisitCounts[nodeIdx] * SAHTraversalCost + work[TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE]] + work[TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE]];
+        }
+        else
+        {
+            // Come back to this node after the children:
+            entry = pushStack(&stack);
+            entry[0] = nodeIdx;
+            entry[1] = 1;
+            entry = pushStack(&stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            entry[1] = 0;
+            entry = pushStack(&stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            entry[1] = 0;
+            continue;
+        }
+        
+        NodeMeasuredCosts[nodeIdx] = (NodeVisitCounts[nodeIdx] > 0) ? work[nodeIdx] / (double) NodeVisitCounts[nodeIdx] : 0.0;
+    }
+    
+    freeStack(&stack);
+    free(work);
+}
+
+// Casts rays from the scene view's camera, then works out how much work each took and how
+// often each node was visited, and builds the cost image. Returns 0 on failure.
+int CastRays(void)
+{
+    double totals[RAY_STATS_SIZE] = {0.0, 0.0, 0.0}, cost, maxCost = 0.0, seconds;
+    float value;
+    int n, m, row, noRays = IMAGE_WIDTH * IMAGE_HEIGHT;
+    
+    if (!SceneryLoaded || noTriangles == 0)
+    {
+        printf("WARNING: Rays can't be cast without a scene loaded.\n\n");
+        return 0;
+    }
+    
+    if (!RayCostImage)
+        RayCostImage = (GLubyte *) malloc(sizeof(GLubyte) * 3 * (size_t) noRays);
+    if (!RayCostImage)
+    {
+        printf("ERROR: Unable to allocate memory for casting rays.\n\n");
+        return 0;
+    }
+    
+    printf("Casting %i rays (%s)... ", noRays, RayCastPackets ? "packets" : "scalar");
+    fflush(stdout);
+    seconds = traceImage(RayCastPackets, NULL);
+    if (seconds < 0.0)
+    {
+        printf("\nERROR: Unable to allocate memory for casting rays.\n\n");
+        return 0;
+    }
+    printf("Done (%f seconds).\n", seconds);
+    
+    // Each ray costs a traversal step per node and an intersection per triangle tested:
+    for (n = 0; n < noRays; n++)
+    {
+        for (m = 0; m < RAY_STATS_SIZE; m++)
+            totals[m] += RayStats[n][m];
+        cost = SAHTraversalCost * RayStats[n][RayStatsNodes] + SAHIntersectionCost * RayStats[n][RayStatsTriangles];
+        if (cost > maxCost)
+            maxCost = cost;
+    }
+    
+    // Then colour the image. GL draws the bottom row first:
+    for (n = 0; n < noRays; n++)
+    {
+        cost = SAHTraversalCost * RayStats[n][RayStatsNodes] + SAHIntersectionCost * RayStats[n][RayStatsTriangles];
+        value = (maxCost > 0.0) ? cost / maxCost : 0.0;
+        row = IMAGE_HEIGHT - 1 - n / IMAGE_WIDTH;
+        heatColour(value, &RayCostImage[((size_t) row * IMAGE_WIDTH + n % IMAGE_WIDTH) * 3]);
+    }
+    
+    NodeVisitMax = 0;
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        if (NodeVisitCounts[n] > NodeVisitMax)
+            NodeVisitMax = NodeVisitCounts[n];
+    }
+    computeMeasuredCosts();
+    
+    printf("Per ray: %f nodes, %f leaves, %f triangle tests, %f cost (worst %f).\n\n", totals[RayStatsNodes] / noRays, totals[RayStatsLeaves] / noRays, totals[RayStatsTriangles] / noRays, (SAHTraversalCost * totals[RayStatsNodes] + SAHIntersectionCost * totals[RayStatsTriangles]) / noRays, maxCost);
+    
+    RaysCast = 1;
+    return 1;
+}
+
+// Times the scalar and packet ray casters against each other from the scene view's camera and
+// checks that they hit the same triangles. Returns 0 on failure.
+int RunRayBenchmark(void)
+{
+    double seconds, best[2];
+    int *hits[2], mode, run, n, noRays = IMAGE_WIDTH * IMAGE_HEIGHT, noHits = 0, noDifferent = 0;
+    
+    if (!SceneryLoaded || noTriangles == 0)
+    {
+        printf("WARNING: Rays can't be cast without a scene loaded.\n\n");
+        return 0;
+    }
+    
+    hits[0] = (int *) malloc(sizeof(int) * (size_t) noRays);
+    hits[1] = (int *) malloc(sizeof(int) * (size_t) noRays);
+    if (!hits[0] || !hits[1])
+    {
+        printf("ERROR: Unable to allocate memory for the ray benchmark.\n\n");
+        free(hits[0]);
+        free(hits[1]);
+        return 0;
+    }
+    
+    printf("Benchmarking %i rays from (%f, %f, %f) towards (%f, %f, %f) on %i threads:\n", noRays, x, y, z, lx, ly, lz, getThreadCount());
+    for (mode = 0; mode < 2; mode++)
+    {
+        best[mode] = -1.0;
+        for (run = 0; run < RAYCAST_BENCHMARK_RUNS; run++)
+        {
+            seconds = traceImage(mode, hits[mode]);
+            if (seconds < 0.0)
+            {
+                printf("ERROR: Unable to allocate memory for the ray benchmark.\n\n");
+                free(hits[0]);
+                free(hits[1]);
+                return 0;
+            }
+            if (best[mode] < 0.0 || seconds < best[mode])
+                best[mode] = seconds;
+        }
+        printf("    %-8s %f seconds, %.0f rays per second\n", (mode == 0) ? "Scalar:" : "Packets:", best[mode], (double) noRays / best[mode]);
+    }
+    
+    for (n = 0; n < noRays; n++)
+    {
+        if (hits[0][n] >= 0)
+            noHits++;
+        if (hits[0][n] != hits[1][n])
+            noDifferent++;
+    }
+    printf("    Speed up: %fx. %i rays hit, %i differ between the two.\n\n", best[0] / best[1], noHits, noDifferent);
+    
+    free(hits[0]);
+    free(hits[1]);
+    return 1;
+}
+
+// Casts a ray through the scene view at the given mouse position and selects the leaf
+// holding the closest hit. Must be called with the scene sub window current. Returns the
+// leaf's index, or -1 if nothing was hit.
+int PickScene(int xmouse, int ymouse)
+{
+    GLdouble modelview[16], projection[16], nearPoint[3], farPoint[3];
+    GLint viewport[4];
+    RayStackEntry *stack;
+    float ray[RAY_VECTOR_SIZE], hitData[HIT_DATA_SIZE];
+    int stats[RAY_STATS_SIZE] = {0, 0, 0};
+    int n, triangleIdx, nodeIdx;
+    
+    if (!SceneryLoaded || noTriangles == 0)
+    {
+        printf("WARNING: Nothing can be picked without a scene loaded.\n\n");
+        return -1;
+    }
+    
+    // Rebuild the matrices the scene was drawn with:
+    glGetIntegerv(GL_VIEWPORT, viewport);
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
     glLoadIdentity();
-    gluPerspective(90.0, 1.0, 3.0, 200.0);
+    gluPerspective(SCENE_VIEW_FOV, SCENE_VIEW_ASPECT, SCENE_VIEW_NEAR, SCENE_VIEW_FAR);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glPopMatrix();
     glMatrixMode(GL_MODELVIEW);
     glPushMatrix();
+    glLoadIdentity();
     gluLookAt(x, y, z, x + lx, y + ly, z + lz, 0, 1, 0);
-    DrawScene();
-    DrawBoxes();
-    glPopMatrix();
-    glMatrixMode(GL_PROJECTION);
+    glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
     glPopMatrix();
     
-    // Finally, swap buffers:
-    glutSwapBuffers();
+    // GLUT counts y down from the top, GL counts it up from the bottom:
+    if (!gluUnProject(xmouse + 0.5, viewport[3] - ymouse - 0.5, 0.0, modelview, projection, viewport, &nearPoint[0], &nearPoint[1], &nearPoint[2]) ||
+        !gluUnProject(xmouse + 0.5, viewport[3] - ymouse - 0.5, 1.0, modelview, projection, viewport, &farPoint[0], &farPoint[1], &farPoint[2]))
+        return -1;
+    
+    for (n = 0; n < 3; n++)
+    {
+        ray[RaySourcex + n] = nearPoint[n];
+        ray[RayDirectionx + n] = farPoint[n] - nearPoint[n];
+    }
+    
+    // Visits aren't counted for a pick. The leaf that held the hit comes back from the cast:
+    stack = (RayStackEntry *) malloc(sizeof(RayStackEntry) * (noTreeDepthLevels + 1));
+    if (!stack)
+    {
+        printf("ERROR: Unable to allocate memory for picking.\n\n");
+        return -1;
+    }
+    
+    triangleIdx = castRay(ray, stack, NULL, stats, hitData, &nodeIdx);
+    free(stack);
+    
+    if (triangleIdx < 0 || nodeIdx < 0)
+    {
+        printf("Nothing picked at %i, %i.\n", xmouse, ymouse);
+        return -1;
+    }
+    
+    printf("Picked triangle %i in leaf node %i after visiting %i nodes and testing %i triangles.\n", triangleIdx, nodeIdx, stats[RayStatsNodes], stats[RayStatsTriangles]);
+    selectNode(nodeIdx);
+    
+    return nodeIdx;
 }
 
-// function to initialise GLUT window and output
-void initialiseGLUT(int argc, char *argv[])
+// Maps a value between 0 and 1 onto a colour from blue (cold) to red (hot).
+void heatColour(float value, GLubyte colour[3])
 {
-    glutInitWindowSize(SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (value < 0.0f)
+        value = 0.0f;
+    if (value > 1.0f)
+        value = 1.0f;
     
-    // Set up the window position:
-    glutInitWindowPosition(0, 0);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_ALPHA | GLUT_DOUBLE | GLUT_DEPTH);
+    colour[0] = (GLubyte) (value * 255.0f);
+    colour[1] = (GLubyte) ((1.0f - fabsf(2.0f * value - 1.0f)) * 255.0f);
+    colour[2] = (GLubyte) ((1.0f - value) * 255.0f);
+}
+
+// Builds the lines for every junction node's box and split plane. Leaf nodes aren't drawn.
+void buildBoxGeometry(void)
+{
+    int n, m, noJunctions = 0;
+    
+    for (n = 0; n < noTreeMatrixEntries; n++)
+        if (TreeMatrix[n][TREE_MATRIX_LEAF_NODE] < 0)
+            noJunctions++;
+    
+    noBoxVertices = noJunctions * BOX_VERTICES_PER_NODE;
+    BoxVertices = malloc(sizeof(float) * 3 * ((size_t) noBoxVertices + 1));
+    BoxColours = malloc(sizeof(GLubyte) * 4 * ((size_t) noBoxVertices + 1));
+    BoxVertexStart = malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    BoxVertexCount = malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    if (!BoxVertices || !BoxColours || !BoxVertexStart || !BoxVertexCount)
+    {
+        printf("ERROR: Unable to allocate the box geometry for %i nodes.\n\n", noJunctions);
+        exit(-1);
+    }
+    
+    noBoxVertices = 0;
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        if (TreeMatrix[n][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            BoxVertexStart[n] = -1;
+            BoxVertexCount[n] = 0;
+            continue;
+        }
+        
+        BoxVertexStart[n] = noBoxVertices;
+        BoxVertexCount[n] = writeBoundaryBox(&BoxVertices[(size_t) noBoxVertices * 3], NodeBounds[n], TreeMatrix[n][TREE_MATRIX_AXIS_INDEX], (float) TreeMatrix[n][TREE_MATRIX_SPLIT_POSITION] / 65536.0);
+        noBoxVertices += BoxVertexCount[n];
+    }
+    
+    // Everything starts off unselected:
+    for (m = 0; m < noBoxVertices; m++)
+    {
+        BoxColours[m * 4 + 0] = (GLubyte) (AABB_DRAW_LINE_COLOUR_R * 255.0);
+        BoxColours[m * 4 + 1] = (GLubyte) (AABB_DRAW_LINE_COLOUR_G * 255.0);
+        BoxColours[m * 4 + 2] = (GLubyte) (AABB_DRAW_LINE_COLOUR_B * 255.0);
+        BoxColours[m * 4 + 3] = 255;
+    }
+}
+
+// Changes the colour of one node's lines in the box buffer.
+void setBoxColour(int nodeIdx, int selected)
+{
+    GLubyte colours[BOX_VERTICES_PER_NODE * 4];
+    int n;
+    
+    if (nodeIdx < 0 || nodeIdx >= noTreeMatrixEntries || BoxVertexStart[nodeIdx] < 0)
+        return;
+    
+    for (n = 0; n < BoxVertexCount[nodeIdx]; n++)
+    {
+        colours[n * 4 + 0] = (GLubyte) ((selected ? AABB_DRAW_LINE_SELECTED_COLOUR_R : AABB_DRAW_LINE_COLOUR_R) * 255.0);
+        colours[n * 4 + 1] = (GLubyte) ((selected ? AABB_DRAW_LINE_SELECTED_COLOUR_G : AABB_DRAW_LINE_COLOUR_G) * 255.0);
+        colours[n * 4 + 2] = (GLubyte) ((selected ? AABB_DRAW_LINE_SELECTED_COLOUR_B : AABB_DRAW_LINE_COLOUR_B) * 255.0);
+        colours[n * 4 + 3] = 255;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, BoxColourBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLubyte) * 4 * (size_t) BoxVertexStart[nodeIdx], sizeof(GLubyte) * 4 * (size_t) BoxVertexCount[nodeIdx], colours);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Makes nodeIdx the selected node and records its box and split.
+void selectNode(int nodeIdx)
+{
+    if (nodeIdx < 0 || nodeIdx >= noTreeMatrixEntries)
+        return;
+    
+    SelectedNodeIdx = nodeIdx;
+    memcpy(&SelectedBBVec[0], NodeBounds[nodeIdx], sizeof(float) * 6);
+    
+    if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+    {
+        SelectedSplitPosition = (float) TreeMatrix[nodeIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0;
+        SelectedSplitAxis = TreeMatrix[nodeIdx][TREE_MATRIX_AXIS_INDEX];
+    }
+}
+
+// Works out the planes of the frustum from the current projection and modelview matrices.
+// Each plane faces inwards, so points inside have a positive distance from all of them.
+void extractFrustum(float planes[FRUSTUM_PLANES][4])
+{
+    float projection[16], modelview[16], clip[16], length;
+    int n, m, k;
+    
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    
+    // GL stores its matrices column by column:
+    for (n = 0; n < 4; n++)
+    {
+        for (m = 0; m < 4; m++)
+        {
+            clip[n * 4 + m] = 0.0;
+            for (k = 0; k < 4; k++)
+                clip[n * 4 + m] += projection[k * 4 + m] * modelview[n * 4 + k];
+        }
+    }
+    
+    // Left, right, bottom, top, near and far are the last row plus or minus each of the others:
+    for (n = 0; n < FRUSTUM_PLANES; n++)
+    {
+        for (m = 0; m < 4; m++)
+            planes[n][m] = clip[m * 4 + 3] + ((n & 1) ? -clip[m * 4 + n / 2] : clip[m * 4 + n / 2]);
+        
+        length = sqrtf(planes[n][0] * planes[n][0] + planes[n][1] * planes[n][1] + planes[n][2] * planes[n][2]);
+        if (length > 0.0)
+            for (m = 0; m < 4; m++)
+                planes[n][m] /= length;
+    }
+}
+
+// Tests a box against the planes still set in the mask. Returns -1 if the box is wholly outside
+// one of them, or else the mask with the planes it's wholly inside of taken out, as the
+// box's children don't need testing against those.
+int classifyBox(const float bbvec[TREE_BOUNDING_BOX_ARRAY_SIZE], float planes[FRUSTUM_PLANES][4], int planeMask)
+{
+    float nearest, furthest, low, high;
+    int n, m;
+    
+    for (n = 0; n < FRUSTUM_PLANES; n++)
+    {
+        if (!(planeMask & (1 << n)))
+            continue;
+        
+        // The corners furthest along and furthest against the plane's normal:
+        nearest = furthest = planes[n][3];
+        for (m = 0; m < 3; m++)
+        {
+            low = planes[n][m] * bbvec[TREE_BOUNDING_BOX_LOCATION_X + m];
+            high = planes[n][m] * (bbvec[TREE_BOUNDING_BOX_LOCATION_X + m] + bbvec[TREE_BOUNDING_BOX_SIZE_X + m]);
+            furthest += fmaxf(low, high);
+            nearest += fminf(low, high);
+        }
+        
+        if (furthest < 0.0)
+            return -1;
+        if (nearest >= 0.0)
+            planeMask &= ~(1 << n);
+    }
+    
+    return planeMask;
+}
+
+// Walks the tree against the frustum of the current matrices. Subtrees outside it are skipped
+// and subtrees wholly inside aren't tested any further. The leaves found are left for
+// DrawScene and the lines of the junction boxes for DrawBoxes.
+void cullSceneToFrustum(void)
+{
+    int n, nodeIdx, planeMask, *entry;
+    
+    if (!NodeBounds || noTreeMatrixEntries <= 0)
+        return;
+    
+    if (!SceneVisibleLeaves)
+    {
+        initialiseStack(&SceneCullStack, 2);
+        SceneVisibleLeaves = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+        SceneVisibleBoxIndices = (GLuint *) malloc(sizeof(GLuint) * ((size_t) noBoxVertices + 1));
+        if (!SceneVisibleLeaves || !SceneVisibleBoxIndices)
+        {
+            printf("ERROR: Unable to allocate the frustum culling lists for %i nodes.\n\n", noTreeMatrixEntries);
+            exit(-1);
+        }
+    }
+    
+    extractFrustum(SceneFrustum);
+    SceneCullFrame++;
+    noSceneVisibleLeaves = 0;
+    noSceneVisibleBoxIndices = 0;
+    
+    // Each entry is a node and the planes its box still has to be tested against:
+    SceneCullStack.size = 0;
+    entry = pushStack(&SceneCullStack);
+    entry[0] = 0;
+    entry[1] = FRUSTUM_ALL_PLANES;
+    
+    while ((entry = popStack(&SceneCullStack)))
+    {
+        nodeIdx = entry[0];
+        planeMask = entry[1];
+        if (planeMask)
+            planeMask = classifyBox(NodeBounds[nodeIdx], SceneFrustum, planeMask);
+        if (planeMask < 0)
+            continue;
+        
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            if (LeafPrimitiveOffsets[nodeIdx + 1] > LeafPrimitiveOffsets[nodeIdx])
+                SceneVisibleLeaves[noSceneVisibleLeaves++] = nodeIdx;
+            continue;
+        }
+        
+        // The index list has room for every box vertex, so each node adds only its own:
+        if (BoxVertexStart && BoxVertexStart[nodeIdx] >= 0)
+        {
+            for (n = 0; n < BoxVertexCount[nodeIdx]; n++)
+                SceneVisibleBoxIndices[noSceneVisibleBoxIndices++] = (GLuint) (BoxVertexStart[nodeIdx] + n);
+        }
+        
+        entry = pushStack(&SceneCullStack);
+        entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+        entry[1] = planeMask;
+        entry = pushStack(&SceneCullStack);
+        entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+        entry[1] = planeMask;
+    }
+}
+
+void DrawBoxes(void)
+{
+    // Hand the geometry over to GL the first time round:
+    if (!BoxBuffersReady)
+    {
+        BoxBuffersReady = 1;
+        glGenBuffers(1, &BoxVertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, BoxVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * (size_t) noBoxVertices, BoxVertices, GL_STATIC_DRAW);
+        glGenBuffers(1, &BoxColourBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, BoxColourBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLubyte) * 4 * (size_t) noBoxVertices, BoxColours, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        
+        // GL has its own copy now:
+        free(BoxVertices);
+        free(BoxColours);
+        BoxVertices = NULL;
+        BoxColours = NULL;
+    }
+    
+    // Only the highlight needs updating when the selection moves:
+    if (BoxHighlightIdx != SelectedNodeIdx)
+    {
+        setBoxColour(BoxHighlightIdx, 0);
+        setBoxColour(SelectedNodeIdx, 1);
+        BoxHighlightIdx = SelectedNodeIdx;
+    }
+    
+    glPushMatrix();
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, BoxVertexBuffer);
+    glVertexPointer(3, GL_FLOAT, 0, (void *) 0);
+    glBindBuffer(GL_ARRAY_BUFFER, BoxColourBuffer);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void *) 0);
+    
+    // Only the boxes the culling walk found in view:
+    glDrawElements(GL_LINES, noSceneVisibleBoxIndices, GL_UNSIGNED_INT, SceneVisibleBoxIndices);
+    
+    // Finally, draw the highlighted one again so it sits on top.
+    if (BoxVertexStart[SelectedNodeIdx] >= 0)
+        glDrawArrays(GL_LINES, BoxVertexStart[SelectedNodeIdx], BoxVertexCount[SelectedNodeIdx]);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopMatrix();
+    
+    // Leaf nodes aren't in the buffer, so outline a selected leaf directly:
+    if (BoxVertexStart[SelectedNodeIdx] < 0)
+        DrawBoundaryBox(SelectedBBVec, -1, 0.0, SelectedNodeIdx);
+}
+
+// Works out where each node sits in the tree view. Nodes are spread evenly across their
+// depth, in the order a left-first walk of the tree meets them.
+void computeTreeLayout(void)
+{
+    int n, depth;
+    
+    free(TreeLayout);
+    TreeLayout = malloc(sizeof(float) * 2 * (size_t) noTreeMatrixEntries);
+    if (!TreeLayout)
+    {
+        printf("ERROR: Unable to allocate the tree layout for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        depth = TreeDepthAssignment[n];
+        
+        // Nodes that can't be reached from the root aren't shown:
+        if (TreeDepthIndex[n] < 0)
+        {
+            TreeLayout[n][0] = 0.0;
+            TreeLayout[n][1] = 0.0;
+            continue;
+        }
+        
+        TreeLayout[n][0] = TreeDepthMaxCount*NODE_DRAW_SQUARE_SIZE * ((float) (TreeDepthIndex[n] + 1) * 2.0 - 1.0) / (float) TreeDepthCounter[depth];
+        TreeLayout[n][1] = -NODE_DRAW_SQUARE_SIZE * 2.0 * (float) depth;
+    }
+    
+    free(TreeSubtreeExtent);
+    free(TreeSubtreeSize);
+    free(TreeViewStack);
+    free(TreeViewLabelEnd);
+    free(TreeViewLastColumn);
+    free(TreeViewLastGlyph);
+    TreeSubtreeExtent = malloc(sizeof(float) * 2 * (size_t) noTreeMatrixEntries);
+    TreeSubtreeSize = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    TreeViewStack = (int *) malloc(sizeof(int) * (size_t) (noTreeDepthLevels + 1));
+    TreeViewLabelEnd = (float *) malloc(sizeof(float) * (size_t) (noTreeDepthLevels + 1));
+    TreeViewLastColumn = (int *) malloc(sizeof(int) * (size_t) (noTreeDepthLevels + 1));
+    TreeViewLastGlyph = (int *) malloc(sizeof(int) * (size_t) (noTreeDepthLevels + 1));
+    if (!TreeSubtreeExtent || !TreeSubtreeSize || !TreeViewStack || !TreeViewLabelEnd || !TreeViewLastColumn || !TreeViewLastGlyph)
+    {
+        printf("ERROR: Unable to allocate the tree view extents for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    // Work up from the deepest level so that children are always done before their parents:
+    for (n = TreeDepthOffsets[noTreeDepthLevels] - 1; n >= 0; n--)
+    {
+        int nodeIdx = TreeDepthNodes[n], child, m;
+        
+        TreeSubtreeExtent[nodeIdx][0] = TreeSubtreeExtent[nodeIdx][1] = TreeLayout[nodeIdx][0];
+        TreeSubtreeSize[nodeIdx] = 1;
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+            continue;
+        
+        for (m = 0; m < 2; m++)
+        {
+            child = TreeMatrix[nodeIdx][(m == 0) ? TREE_MATRIX_LEFT_NODE : TREE_MATRIX_RIGHT_NODE];
+            TreeSubtreeExtent[nodeIdx][0] = fminf(TreeSubtreeExtent[nodeIdx][0], TreeSubtreeExtent[child][0]);
+            TreeSubtreeExtent[nodeIdx][1] = fmaxf(TreeSubtreeExtent[nodeIdx][1], TreeSubtreeExtent[child][1]);
+            TreeSubtreeSize[nodeIdx] += TreeSubtreeSize[child];
+        }
+    }
+}
+
+// Builds a square for every node and a line from every junction node to its children.
+void buildTreeGeometry(void)
+{
+    float xmin, ymin, xmax, ymax;
+    int n, m, child;
+    
+    TreeNodeVertices = malloc(sizeof(float) * 2 * 4 * ((size_t) noTreeMatrixEntries));
+    TreeNodeColours = malloc(sizeof(GLubyte) * 4 * 4 * ((size_t) noTreeMatrixEntries));
+    TreeLineVertices = malloc(sizeof(float) * 2 * 4 * ((size_t) noTreeMatrixEntries));
+    free(TreeLineStart);
+    free(TreeViewGlyphs);
+    free(TreeViewGlyphCounts);
+    free(TreeVisibleQuads);
+    free(TreeVisibleLines);
+    TreeLineStart = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    TreeViewGlyphs = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    TreeViewGlyphCounts = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    TreeVisibleQuads = (GLuint *) malloc(sizeof(GLuint) * 4 * (size_t) noTreeMatrixEntries);
+    TreeVisibleLines = (GLuint *) malloc(sizeof(GLuint) * 4 * (size_t) noTreeMatrixEntries);
+    if (!TreeNodeVertices || !TreeNodeColours || !TreeLineVertices || !TreeLineStart || !TreeViewGlyphs || !TreeViewGlyphCounts || !TreeVisibleQuads || !TreeVisibleLines)
+    {
+        printf("ERROR: Unable to allocate the tree view geometry for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    noTreeLineVertices = 0;
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        // Define corners of square
+        xmin = TreeLayout[n][0] - NODE_DRAW_SQUARE_SIZE / 2.0;
+        xmax = xmin + NODE_DRAW_SQUARE_SIZE;
+        ymin = TreeLayout[n][1] - NODE_DRAW_SQUARE_SIZE / 2.0;
+        ymax = ymin + NODE_DRAW_SQUARE_SIZE;
+        
+        // Collapse the squares of unreachable nodes so they don't show:
+        if (TreeDepthIndex[n] < 0)
+        {
+            xmax = xmin;
+            ymax = ymin;
+        }
+        
+        TreeNodeVertices[n * 8 + 0] = xmin;
+        TreeNodeVertices[n * 8 + 1] = ymin;
+        TreeNodeVertices[n * 8 + 2] = xmin;
+        TreeNodeVertices[n * 8 + 3] = ymax;
+        TreeNodeVertices[n * 8 + 4] = xmax;
+        TreeNodeVertices[n * 8 + 5] = ymax;
+        TreeNodeVertices[n * 8 + 6] = xmax;
+        TreeNodeVertices[n * 8 + 7] = ymin;
+        
+        for (m = 0; m < 4; m++)
+        {
+            TreeNodeColours[(n * 4 + m) * 4 + 0] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_R * 255.0);
+            TreeNodeColours[(n * 4 + m) * 4 + 1] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_G * 255.0);
+            TreeNodeColours[(n * 4 + m) * 4 + 2] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_B * 255.0);
+            TreeNodeColours[(n * 4 + m) * 4 + 3] = 255;
+        }
+        
+        // Then the lines down to the children:
+        TreeLineStart[n] = -1;
+        if (TreeDepthIndex[n] < 0 || TreeMatrix[n][TREE_MATRIX_LEAF_NODE] >= 0)
+            continue;
+        
+        TreeLineStart[n] = noTreeLineVertices;
+        for (m = 0; m < 2; m++)
+        {
+            child = TreeMatrix[n][(m == 0) ? TREE_MATRIX_LEFT_NODE : TREE_MATRIX_RIGHT_NODE];
+            TreeLineVertices[noTreeLineVertices * 2 + 0] = TreeLayout[n][0];
+            TreeLineVertices[noTreeLineVertices * 2 + 1] = TreeLayout[n][1];
+            TreeLineVertices[noTreeLineVertices * 2 + 2] = TreeLayout[child][0];
+            TreeLineVertices[noTreeLineVertices * 2 + 3] = TreeLayout[child][1];
+            noTreeLineVertices += 2;
+        }
+    }
+}
+
+// Works out the colour of a node's square. With the heatmap showing, nodes are coloured by how
+// often rays visited them on a log scale.
+void treeNodeColour(int nodeIdx, int selected, GLubyte colour[4])
+{
+    if (selected)
+    {
+        colour[0] = (GLubyte) (NODE_DRAW_SQUARE_SELECTED_COLOUR_R * 255.0);
+        colour[1] = (GLubyte) (NODE_DRAW_SQUARE_SELECTED_COLOUR_G * 255.0);
+        colour[2] = (GLubyte) (NODE_DRAW_SQUARE_SELECTED_COLOUR_B * 255.0);
+    }
+    else if (ShowRayHeatmap && NodeVisitMax > 0)
+    {
+        heatColour(log1p((double) NodeVisitCounts[nodeIdx]) / log1p((double) NodeVisitMax), colour);
+    }
+    else
+    {
+        colour[0] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_R * 255.0);
+        colour[1] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_G * 255.0);
+        colour[2] = (GLubyte) (NODE_DRAW_SQUARE_COLOUR_B * 255.0);
+    }
+    colour[3] = 255;
+}
+
+// Changes the colour of one node's square in the tree view buffer.
+void setTreeNodeColour(int nodeIdx, int selected)
+{
+    GLubyte colours[4 * 4];
+    int n;
+    
+    if (nodeIdx < 0 || nodeIdx >= noTreeMatrixEntries)
+        return;
+    
+    treeNodeColour(nodeIdx, selected, colours);
+    for (n = 1; n < 4; n++)
+        memcpy(&colours[n * 4], colours, 4);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, TreeNodeColourBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(colours) * (size_t) nodeIdx, sizeof(colours), colours);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Changes the colour of every node's square, for when the heatmap is shown or hidden.
+void recolourTreeNodes(void)
+{
+    GLubyte *colours;
+    int n, m;
+    
+    colours = (GLubyte *) malloc(sizeof(GLubyte) * 4 * 4 * (size_t) noTreeMatrixEntries);
+    if (!colours)
+        return;
+    
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        treeNodeColour(n, n == SelectedNodeIdx, &colours[n * 16]);
+        for (m = 1; m < 4; m++)
+            memcpy(&colours[n * 16 + m * 4], &colours[n * 16], 4);
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, TreeNodeColourBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLubyte) * 4 * 4 * (size_t) noTreeMatrixEntries, colours);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(colours);
+    
+    TreeHighlightIdx = SelectedNodeIdx;
+    TreeColoursStale = 0;
+}
+
+// Walks down from the root to find what's in view. Subtrees off to the side or below the view
+// are skipped. Subtrees narrower than a pixel or so, and nodes that would land in the same
+// pixel column as the last one at their depth, are counted into glyphs rather than walked.
+// The squares and lines to draw are left in the visible index arrays. Returns the number of
+// nodes visited.
+int collectVisibleTreeNodes(int *noGlyphs, int *noQuads, int *noLines)
+{
+    float left, right, top, bottom;
+    int n, nodeIdx, depth, column, stackSize = 0, noVisited = 0;
+    
+    // The view in layout coordinates, grown by a square so that nodes on the edge still show:
+    left = TreeViewOrigin[0] - TREE_VIEW_MARGIN / TreeViewZoom - NODE_DRAW_SQUARE_SIZE;
+    right = TreeViewOrigin[0] + (TREE_VIEW_WIDTH - TREE_VIEW_MARGIN) / TreeViewZoom + NODE_DRAW_SQUARE_SIZE;
+    top = TreeViewOrigin[1] + TREE_VIEW_MARGIN / TreeViewZoom + NODE_DRAW_SQUARE_SIZE;
+    bottom = TreeViewOrigin[1] - (TREE_VIEW_HEIGHT - TREE_VIEW_MARGIN) / TreeViewZoom - NODE_DRAW_SQUARE_SIZE;
+    
+    *noGlyphs = *noQuads = *noLines = 0;
+    if (noTreeMatrixEntries <= 0)
+        return 0;
+    
+    for (depth = 0; depth < noTreeDepthLevels; depth++)
+    {
+        TreeViewLastColumn[depth] = INT_MIN;
+        TreeViewLastGlyph[depth] = -1;
+    }
+    
+    TreeViewStack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        nodeIdx = TreeViewStack[--stackSize];
+        noVisited++;
+        
+        // Children are always further down, so nothing below the view can be seen:
+        if (TreeSubtreeExtent[nodeIdx][1] < left || TreeSubtreeExtent[nodeIdx][0] > right || TreeLayout[nodeIdx][1] < bottom)
+            continue;
+        
+        depth = TreeDepthAssignment[nodeIdx];
+        column = (int) floor((TreeLayout[nodeIdx][0] - TreeViewOrigin[0]) * TreeViewZoom);
+        if (column == TreeViewLastColumn[depth] ||
+            (TreeSubtreeSize[nodeIdx] > 1 && (TreeSubtreeExtent[nodeIdx][1] - TreeSubtreeExtent[nodeIdx][0]) * TreeViewZoom < TREE_VIEW_COLLAPSE_WIDTH))
+        {
+            // Add to the glyph already in this column if there is one:
+            if (column == TreeViewLastColumn[depth] && TreeViewLastGlyph[depth] >= 0)
+                TreeViewGlyphCounts[TreeViewLastGlyph[depth]] += TreeSubtreeSize[nodeIdx];
+            else
+            {
+                TreeViewGlyphs[*noGlyphs] = nodeIdx;
+                TreeViewGlyphCounts[*noGlyphs] = TreeSubtreeSize[nodeIdx];
+                TreeViewLastGlyph[depth] = (*noGlyphs)++;
+            }
+            TreeViewLastColumn[depth] = column;
+            continue;
+        }
+        TreeViewLastColumn[depth] = column;
+        TreeViewLastGlyph[depth] = -1;
+        
+        if (TreeLayout[nodeIdx][1] <= top)
+        {
+            for (n = 0; n < 4; n++)
+                TreeVisibleQuads[(*noQuads)++] = (GLuint) (nodeIdx * 4 + n);
+        }
+        
+        if (TreeLineStart[nodeIdx] < 0)
+            continue;
+        
+        for (n = 0; n < 4; n++)
+            TreeVisibleLines[(*noLines)++] = (GLuint) (TreeLineStart[nodeIdx] + n);
+        
+        // Right first so that the left is walked first, meeting each depth from left to right:
+        TreeViewStack[stackSize++] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+        TreeViewStack[stackSize++] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+    }
+    
+    return noVisited;
+}
+
+// Function to draw the tree. Only the part in view is drawn, so the cost follows what's on
+// screen rather than the size of the tree.
+void DrawTree(void)
+{
+    char charString[16];
+    float xpos, ypos, labelStart, halfSize = NODE_DRAW_SQUARE_SIZE / 2.0;
+    int n, depth, noGlyphs, noQuads, noLines;
+    
+    // Hand the geometry over to GL the first time round:
+    if (!TreeBuffersReady)
+    {
+        TreeBuffersReady = 1;
+        glGenBuffers(1, &TreeNodeVertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, TreeNodeVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * 4 * (size_t) noTreeMatrixEntries, TreeNodeVertices, GL_STATIC_DRAW);
+        glGenBuffers(1, &TreeNodeColourBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, TreeNodeColourBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLubyte) * 4 * 4 * (size_t) noTreeMatrixEntries, TreeNodeColours, GL_DYNAMIC_DRAW);
+        glGenBuffers(1, &TreeLineVertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, TreeLineVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * (size_t) noTreeLineVertices, TreeLineVertices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        
+        // GL has its own copy now:
+        free(TreeNodeVertices);
+        free(TreeNodeColours);
+        free(TreeLineVertices);
+        TreeNodeVertices = TreeLineVertices = NULL;
+        TreeNodeColours = NULL;
+    }
+    
+    // Only the highlight needs updating when the selection moves:
+    if (TreeColoursStale)
+        recolourTreeNodes();
+    else if (TreeHighlightIdx != SelectedNodeIdx)
+    {
+        setTreeNodeColour(TreeHighlightIdx, 0);
+        setTreeNodeColour(SelectedNodeIdx, 1);
+        TreeHighlightIdx = SelectedNodeIdx;
+    }
+    
+    collectVisibleTreeNodes(&noGlyphs, &noQuads, &noLines);
+    
+    glPushMatrix();
+    glScalef(TreeViewZoom, TreeViewZoom, 1.0);
+    glTranslatef(-TreeViewOrigin[0], -TreeViewOrigin[1], 0.0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    
+    // Lines first so that the squares sit on top of them:
+    glColor3f(NODE_DRAW_LINE_COLOUR_R, NODE_DRAW_LINE_COLOUR_G, NODE_DRAW_LINE_COLOUR_B);
+    glBindBuffer(GL_ARRAY_BUFFER, TreeLineVertexBuffer);
+    glVertexPointer(2, GL_FLOAT, 0, (void *) 0);
+    glDrawElements(GL_LINES, noLines, GL_UNSIGNED_INT, TreeVisibleLines);
+    
+    // Then the squares in view:
+    glEnableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, TreeNodeVertexBuffer);
+    glVertexPointer(2, GL_FLOAT, 0, (void *) 0);
+    glBindBuffer(GL_ARRAY_BUFFER, TreeNodeColourBuffer);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void *) 0);
+    glDrawElements(GL_QUADS, noQuads, GL_UNSIGNED_INT, TreeVisibleQuads);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    
+    // Collapsed nodes are a triangle in place of the first of them:
+    glColor3f(NODE_DRAW_GLYPH_COLOUR_R, NODE_DRAW_GLYPH_COLOUR_G, NODE_DRAW_GLYPH_COLOUR_B);
+    glBegin(GL_TRIANGLES);
+    for (n = 0; n < noGlyphs; n++)
+    {
+        xpos = TreeLayout[TreeViewGlyphs[n]][0];
+        ypos = TreeLayout[TreeViewGlyphs[n]][1];
+        glVertex2f(xpos, ypos + halfSize);
+        glVertex2f(xpos - halfSize, ypos - halfSize);
+        glVertex2f(xpos + halfSize, ypos - halfSize);
+    }
+    glEnd();
+    
+    // And labelled with their node count where it fits. Glyphs are found left to right across
+    // each depth, so a label only has to clear the last one drawn at its depth:
+    for (depth = 0; depth < noTreeDepthLevels; depth++)
+        TreeViewLabelEnd[depth] = -FLT_MAX;
+    for (n = 0; n < noGlyphs; n++)
+    {
+        depth = TreeDepthAssignment[TreeViewGlyphs[n]];
+        xpos = TreeLayout[TreeViewGlyphs[n]][0] + halfSize + 2.0 / TreeViewZoom;
+        labelStart = (xpos - TreeViewOrigin[0]) * TreeViewZoom;
+        if (labelStart < TreeViewLabelEnd[depth])
+            continue;
+        
+        sprintf(charString, "%i", TreeViewGlyphCounts[n]);
+        TreeViewLabelEnd[depth] = labelStart + (float) (strlen(charString) + 1) * TREE_VIEW_LABEL_CHAR_WIDTH;
+        glRasterPos2f(xpos, TreeLayout[TreeViewGlyphs[n]][1] - halfSize);
+        glutBitmapString(GLUT_BITMAP_HELVETICA_10, charString);
+    }
+    glPopMatrix();
+}
+
+// Zooms the tree view by the factor, keeping the point under the mouse where it is.
+void zoomTreeView(int xmouse, int ymouse, float factor)
+{
+    float newZoom, xpos, ypos;
+    
+    newZoom = fminf(fmaxf(TreeViewZoom * factor, TREE_VIEW_MIN_ZOOM), TREE_VIEW_MAX_ZOOM);
+    xpos = TreeViewOrigin[0] + ((float) xmouse - TREE_VIEW_MARGIN) / TreeViewZoom;
+    ypos = TreeViewOrigin[1] + (TREE_VIEW_MARGIN - (float) ymouse) / TreeViewZoom;
+    
+    TreeViewZoom = newZoom;
+    TreeViewOrigin[0] = xpos - ((float) xmouse - TREE_VIEW_MARGIN) / TreeViewZoom;
+    TreeViewOrigin[1] = ypos - (TREE_VIEW_MARGIN - (float) ymouse) / TreeViewZoom;
+}
+
+// Zooms the tree view so that the whole tree fits across and down it.
+void fitTreeView(void)
+{
+    float width, height;
+    
+    width = TreeDepthMaxCount * NODE_DRAW_SQUARE_SIZE * 2.0;
+    height = NODE_DRAW_SQUARE_SIZE * 2.0 * (float) noTreeDepthLevels;
+    
+    TreeViewOrigin[0] = TreeViewOrigin[1] = 0.0;
+    TreeViewZoom = fminf((TREE_VIEW_WIDTH - 2 * TREE_VIEW_MARGIN) / fmaxf(width, 1.0), (TREE_VIEW_HEIGHT - 2 * TREE_VIEW_MARGIN) / fmaxf(height, 1.0));
+    TreeViewZoom = fminf(fmaxf(TreeViewZoom, TREE_VIEW_MIN_ZOOM), TREE_VIEW_MAX_ZOOM);
+}
+
+// Function to initialise the tree depth counter:
+void initialiseTreeDepthCounter(void)
+{
+    int n;
+    for (n = 0; n < TreeDepthCapacity; n++)
+        TreeDepthCounter[n] = 0;
+    noTreeDepthLevels = 0;
+    TreeDepthMaxCount = 0;
+    
+    // The depth assignment and index are sized by the number of nodes in the loaded tree:
+    free(TreeDepthAssignment);
+    free(TreeDepthIndex);
+    TreeDepthAssignment = (int *) calloc(noTreeMatrixEntries, sizeof(int));
+    TreeDepthIndex = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    if (!TreeDepthAssignment || !TreeDepthIndex)
+    {
+        printf("ERROR: Unable to allocate the depth assignment for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    // Nodes that are never reached keep an index of -1:
+    for (n = 0; n < noTreeMatrixEntries; n++)
+        TreeDepthIndex[n] = -1;
+}
+
+// Makes sure the depth counter has an entry for the given depth.
+void growTreeDepthCounter(int depth)
+{
+    int n, newCapacity, *newCounter;
+    
+    if (depth >= TreeDepthCapacity)
+    {
+        newCapacity = (TreeDepthCapacity > 0) ? TreeDepthCapacity : MAX_TREE_DEPTH + 1;
+        while (newCapacity <= depth)
+            newCapacity *= 2;
+        
+        newCounter = realloc(TreeDepthCounter, sizeof(int) * (size_t) newCapacity);
+        if (!newCounter)
+        {
+            printf("ERROR: Unable to allocate the depth counter for %i levels.\n\n", newCapacity);
+            exit(-1);
+        }
+        for (n = TreeDepthCapacity; n < newCapacity; n++)
+            newCounter[n] = 0;
+        
+        TreeDepthCounter = newCounter;
+        TreeDepthCapacity = newCapacity;
+    }
+    
+    if (depth >= noTreeDepthLevels)
+        noTreeDepthLevels = depth + 1;
+}
+
+void initialiseTreeNodeCounter(void)
+{
+    // Allocate one (zeroed) counter per node in the loaded tree:
+    free(TreeNodeCounter);
+    TreeNodeCounter = (int *) calloc(noTreeMatrixEntries, sizeof(int));
+    if (!TreeNodeCounter)
+    {
+        printf("ERROR: Unable to allocate the node counter for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+}
+
+// Counts the primitives in a leaf node's list.
+int countLeafPrimitives(int nodeIdx)
+{
+    return LeafPrimitiveOffsets[nodeIdx + 1] - LeafPrimitiveOffsets[nodeIdx];
+}
+
+// Walks a subtree left first, recording each node's depth and its place within that depth
+// of the subtree, and counting the primitives beneath every node. Junction nodes are visited
+// a second time, once both of their children have been counted. Returns 0 on failure.
+int countSubtreeStatistics(TreeStatsTask *task, int baseDepth, TraversalStack *stack)
+{
+    int n, nodeIdx, level, newCapacity, *newCounts, *entry;
+    
+    entry = pushStack(stack);
+    entry[0] = task->rootIdx;
+    entry[1] = 0;
+    entry[2] = 0;
+    
+    while ((entry = popStack(stack)))
+    {
+        nodeIdx = entry[0];
+        level = entry[1];
+        
+        if (entry[2])
+        {
+            // Second visit, so both children are done:
+            TreeNodeCounter[nodeIdx] = TreeNodeCounter[TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE]] + TreeNodeCounter[TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE]];
+            continue;
+        }
+        
+        if (level >= task->depthCapacity)
+        {
+            newCapacity = (task->depthCapacity > 0) ? task->depthCapacity * 2 : MAX_TREE_DEPTH + 1;
+            newCounts = realloc(task->depthCounts, sizeof(int) * (size_t) newCapacity);
+            if (!newCounts)
+                return 0;
+            for (n = task->depthCapacity; n < newCapacity; n++)
+                newCounts[n] = 0;
+            task->depthCounts = newCounts;
+            task->depthCapacity = newCapacity;
+        }
+        if (level >= task->noDepthLevels)
+            task->noDepthLevels = level + 1;
+        
+        // Record where this node comes within its depth. The subtrees to the left are added on later.
+        TreeDepthIndex[nodeIdx] = task->depthCounts[level]++;
+        TreeDepthAssignment[nodeIdx] = baseDepth + level;
+        
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            TreeNodeCounter[nodeIdx] = countLeafPrimitives(nodeIdx);
+        }
+        else
+        {
+            // Come back to this node after the children, which are queued with the left on top:
+            entry = pushStack(stack);
+            entry[0] = nodeIdx;
+            entry[1] = level;
+            entry[2] = 1;
+            entry = pushStack(stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            entry[1] = level + 1;
+            entry[2] = 0;
+            entry = pushStack(stack);
+            entry[0] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            entry[1] = level + 1;
+            entry[2] = 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Adds the number of nodes to the left of a subtree at each depth onto its depth indices.
+void offsetSubtreeDepthIndices(TreeStatsTask *task, int baseDepth, TraversalStack *stack)
+{
+    int nodeIdx;
+    
+    *pushStack(stack) = task->rootIdx;
+    
+    while (stack->size > 0)
+    {
+        nodeIdx = *popStack(stack);
+        TreeDepthIndex[nodeIdx] += task->depthCounts[TreeDepthAssignment[nodeIdx] - baseDepth];
+        
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+        {
+            *pushStack(stack) = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            *pushStack(stack) = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+        }
+    }
+}
+
+// Worker thread for the tree statistics. Subtrees are handed out until there are none left.
+void *_childTreeStatistics(void *arg)
+{
+    TreeStatsEngine *engine = (TreeStatsEngine *) arg;
+    TraversalStack stack;
+    int task, success = 1;
+    
+    initialiseStack(&stack, engine->applyOffsets ? 1 : 3);
+    
+    while ((task = __sync_fetch_and_add(&engine->nextTask, 1)) < engine->noTasks)
+    {
+        if (engine->applyOffsets)
+            offsetSubtreeDepthIndices(&engine->tasks[task], engine->baseDepth, &stack);
+        else if (!countSubtreeStatistics(&engine->tasks[task], engine->baseDepth, &stack))
+            success = 0;
+    }
+    
+    freeStack(&stack);
+    return success ? (void *) 1 : (void *) 0;
+}
+
+// Works out the depth counts, depth indices and primitive counts for the whole tree. The top
+// of the tree is walked level by level until it's wide enough to be split into subtrees,
+// which are then counted in parallel and merged. The results match a serial left first walk.
+void populateTreeStatistics(void)
+{
+    TreeStatsEngine engine;
+    TraversalStack topNodes;
+    int *frontier, *nextFrontier, *swap, noFrontier, noNext, target, depth, level, offset, count, nodeIdx, n, found;
+    
+    target = getThreadCount() * TREE_STATS_TASKS_PER_THREAD;
+    frontier = (int *) malloc(sizeof(int) * 2 * (size_t) target);
+    nextFrontier = (int *) malloc(sizeof(int) * 2 * (size_t) target);
+    if (!frontier || !nextFrontier)
+    {
+        printf("ERROR: Unable to allocate memory for the tree statistics.\n\n");
+        exit(-1);
+    }
+    
+    // Walk the top of the tree a level at a time. Each level is already in left to right order.
+    initialiseStack(&topNodes, 1);
+    frontier[0] = 0;
+    noFrontier = 1;
+    depth = 0;
+    
+    while (noFrontier > 0 && noFrontier < target)
+    {
+        growTreeDepthCounter(depth);
+        noNext = 0;
+        
+        for (n = 0; n < noFrontier; n++)
+        {
+            nodeIdx = frontier[n];
+            TreeDepthIndex[nodeIdx] = TreeDepthCounter[depth]++;
+            TreeDepthAssignment[nodeIdx] = depth;
+            *pushStack(&topNodes) = nodeIdx;
+            
+            if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+            {
+                TreeNodeCounter[nodeIdx] = countLeafPrimitives(nodeIdx);
+            }
+            else
+            {
+                nextFrontier[noNext++] = TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+                nextFrontier[noNext++] = TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            }
+        }
+        
+        swap = frontier;
+        frontier = nextFrontier;
+        nextFrontier = swap;
+        noFrontier = noNext;
+        depth++;
+    }
+    
+    // Whatever is left in the frontier is shared out as subtrees:
+    engine.noTasks = noFrontier;
+    engine.nextTask = 0;
+    engine.baseDepth = depth;
+    engine.applyOffsets = 0;
+    engine.tasks = (TreeStatsTask *) calloc(noFrontier + 1, sizeof(TreeStatsTask));
+    if (!engine.tasks)
+    {
+        printf("ERROR: Unable to allocate memory for the tree statistics.\n\n");
+        exit(-1);
+    }
+    for (n = 0; n < noFrontier; n++)
+        engine.tasks[n].rootIdx = frontier[n];
+    
+    if (!runWorkerThreads(_childTreeStatistics, &engine, engine.noTasks))
+    {
+        printf("ERROR: Unable to allocate memory for the tree statistics.\n\n");
+        exit(-1);
+    }
+    
+    // Merge the subtree counts. Each subtree's count becomes the number of nodes to its left.
+    for (level = 0; ; level++)
+    {
+        offset = 0;
+        found = 0;
+        for (n = 0; n < engine.noTasks; n++)
+        {
+            if (level < engine.tasks[n].noDepthLevels)
+            {
+                count = engine.tasks[n].depthCounts[level];
+                engine.tasks[n].depthCounts[level] = offset;
+                offset += count;
+                found = 1;
+            }
+        }
+        if (!found)
+            break;
+        
+        growTreeDepthCounter(depth + level);
+        TreeDepthCounter[depth + level] = offset;
+    }
+    
+    // The leftmost subtree has nothing to add on:
+    if (engine.noTasks > 1)
+    {
+        engine.nextTask = 0;
+        engine.applyOffsets = 1;
+        runWorkerThreads(_childTreeStatistics, &engine, engine.noTasks);
+    }
+    
+    // Junction nodes above the subtrees are counted last, children before parents:
+    for (n = topNodes.size - 1; n >= 0; n--)
+    {
+        nodeIdx = topNodes.entries[n];
+        if (TreeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
+            TreeNodeCounter[nodeIdx] = TreeNodeCounter[TreeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE]] + TreeNodeCounter[TreeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE]];
+    }
+    
+    for (n = 0; n < noTreeDepthLevels; n++)
+    {
+        if (TreeDepthCounter[n] > TreeDepthMaxCount)
+            TreeDepthMaxCount = TreeDepthCounter[n];
+    }
+    
+    for (n = 0; n < engine.noTasks; n++)
+        free(engine.tasks[n].depthCounts);
+    free(engine.tasks);
+    freeStack(&topNodes);
+    free(frontier);
+    free(nextFrontier);
+    
+    buildTreeDepthTables();
+}
+
+// Fills in the per-depth node tables from the depth assignments and indices.
+void buildTreeDepthTables(void)
+{
+    int n, depth;
+    
+    free(TreeDepthOffsets);
+    free(TreeDepthNodes);
+    TreeDepthOffsets = (int *) malloc(sizeof(int) * (size_t) (noTreeDepthLevels + 1));
+    TreeDepthNodes = (int *) malloc(sizeof(int) * (size_t) noTreeMatrixEntries);
+    if (!TreeDepthOffsets || !TreeDepthNodes)
+    {
+        printf("ERROR: Unable to allocate the depth tables for %i nodes.\n\n", noTreeMatrixEntries);
+        exit(-1);
+    }
+    
+    TreeDepthOffsets[0] = 0;
+    for (depth = 0; depth < noTreeDepthLevels; depth++)
+        TreeDepthOffsets[depth + 1] = TreeDepthOffsets[depth] + TreeDepthCounter[depth];
+    
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        if (TreeDepthIndex[n] >= 0)
+            TreeDepthNodes[TreeDepthOffsets[TreeDepthAssignment[n]] + TreeDepthIndex[n]] = n;
+    }
+}
+
+// Finds the node drawn at the given position in the tree view's coordinates. Each node owns
+// the cell around it that's as wide as its share of the row. Returns -1 if there's no node there.
+int treeNodeAt(float xpos, float ypos)
+{
+    int depth, index;
+    
+    depth = (int) floor(-ypos / (NODE_DRAW_SQUARE_SIZE * 2.0) + 0.5);
+    if (depth < 0 || depth >= noTreeDepthLevels || TreeDepthCounter[depth] == 0)
+        return -1;
+    
+    index = (int) floor(xpos * (float) TreeDepthCounter[depth] / ((float) TreeDepthMaxCount * NODE_DRAW_SQUARE_SIZE * 2.0));
+    if (index < 0 || index >= TreeDepthCounter[depth])
+        return -1;
+    
+    return TreeDepthNodes[TreeDepthOffsets[depth] + index];
+}
+
+// Works out the comparison figures for a tree in one walk. Node bounds and costs are worked
+// out along the way in the same way as computeNodeBounds and computeNodeCosts, but into
+// the tree's own arrays, so that several trees can be summarised at once. Returns 0 if
+// memory ran out.
+int summariseTree(TreeContext *tree, TreeSummary *summary, TraversalStack *stack)
+{
+    float (*bounds)[TREE_BOUNDING_BOX_ARRAY_SIZE], *costs, splitPos, area;
+    unsigned char *seen;
+    int n, nodeIdx, depth, revisit, count, bucket, leftIdx, rightIdx, splitAxis, maxPrimitive = -1, depthCapacity = 0, *entry, *newCounts;
+    
+    memset(summary, 0, sizeof(TreeSummary));
+    
+    for (n = 0; n < tree->noLeafPrimitives; n++)
+    {
+        if (tree->leafPrimitives[n] > maxPrimitive)
+            maxPrimitive = tree->leafPrimitives[n];
+    }
+    
+    bounds = malloc(sizeof(float) * TREE_BOUNDING_BOX_ARRAY_SIZE * (size_t) tree->noTreeMatrixEntries);
+    costs = (float *) malloc(sizeof(float) * (size_t) tree->noTreeMatrixEntries);
+    // A tree without any primitives still gets a byte, as calloc may return NULL for none:
+    seen = (unsigned char *) calloc((maxPrimitive >= 0) ? maxPrimitive + 1 : 1, sizeof(unsigned char));
+    if (!bounds || !costs || !seen)
+    {
+        free(bounds);
+        free(costs);
+        free(seen);
+        return 0;
+    }
+    
+    for (n = 0; n < 6; n++)
+        bounds[0][n] = (float) tree->boundingBox[n] / 65536.0;
+    
+    // Each entry is a node, its depth and whether its children are done:
+    stack->size = 0;
+    entry = pushStack(stack);
+    entry[0] = 0;
+    entry[1] = 0;
+    entry[2] = 0;
+    
+    while ((entry = popStack(stack)))
+    {
+        nodeIdx = entry[0];
+        depth = entry[1];
+        revisit = entry[2];
+        
+        if (revisit)
+        {
+            leftIdx = tree->treeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+            rightIdx = tree->treeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+            area = nodeSurfaceArea(bounds[nodeIdx]);
+            if (area > 0.0)
+                costs[nodeIdx] = SAHTraversalCost + (nodeSurfaceArea(bounds[leftIdx]) * costs[leftIdx] + nodeSurfaceArea(bounds[rightIdx]) * costs[rightIdx]) / area;
+            else
+                costs[nodeIdx] = SAHTraversalCost + costs[leftIdx] + costs[rightIdx];
+            continue;
+        }
+        
+        if (depth >= depthCapacity)
+        {
+            depthCapacity = (depthCapacity > 0) ? depthCapacity * 2 : MAX_TREE_DEPTH + 1;
+            newCounts = (int *) realloc(summary->depthCounts, sizeof(int) * (size_t) depthCapacity);
+            if (!newCounts)
+            {
+                free(bounds);
+                free(costs);
+                free(seen);
+                return 0;
+            }
+            summary->depthCounts = newCounts;
+            for (n = summary->noDepthLevels; n < depthCapacity; n++)
+                summary->depthCounts[n] = 0;
+        }
+        summary->depthCounts[depth]++;
+        if (depth >= summary->noDepthLevels)
+            summary->noDepthLevels = depth + 1;
+        summary->noNodes++;
+        
+        if (tree->treeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE] >= 0)
+        {
+            count = tree->leafPrimitiveOffsets[nodeIdx + 1] - tree->leafPrimitiveOffsets[nodeIdx];
+            costs[nodeIdx] = SAHIntersectionCost * (float) count;
+            
+            summary->noLeaves++;
+            summary->noReferences += count;
+            if (count == 0)
+                summary->noEmptyLeaves++;
+            if (count > summary->maxLeafPrimitives)
+                summary->maxLeafPrimitives = count;
+            
+            // Bucket 0 is empty and bucket n holds 2^(n - 1) up to 2^n - 1 primitives:
+            for (bucket = 0; count > 0 && bucket < LEAF_OCCUPANCY_BUCKETS - 1; count >>= 1)
+                bucket++;
+            summary->leafOccupancy[bucket]++;
+            
+            for (n = tree->leafPrimitiveOffsets[nodeIdx]; n < tree->leafPrimitiveOffsets[nodeIdx + 1]; n++)
+            {
+                if (tree->leafPrimitives[n] >= 0 && !seen[tree->leafPrimitives[n]])
+                {
+                    seen[tree->leafPrimitives[n]] = 1;
+                    summary->noUniquePrimitives++;
+                }
+            }
+            continue;
+        }
+        
+        // Pass the bounds down before the children are visited:
+        splitPos = (float) tree->treeMatrix[nodeIdx][TREE_MATRIX_SPLIT_POSITION] / 65536.0;
+        splitAxis = tree->treeMatrix[nodeIdx][TREE_MATRIX_AXIS_INDEX];
+        leftIdx = tree->treeMatrix[nodeIdx][TREE_MATRIX_LEFT_NODE];
+        rightIdx = tree->treeMatrix[nodeIdx][TREE_MATRIX_RIGHT_NODE];
+        memcpy(bounds[leftIdx], bounds[nodeIdx], sizeof(float) * 6);
+        bounds[leftIdx][TREE_BOUNDING_BOX_SIZE_X + splitAxis] = splitPos - bounds[leftIdx][TREE_BOUNDING_BOX_LOCATION_X + splitAxis];
+        memcpy(bounds[rightIdx], bounds[nodeIdx], sizeof(float) * 6);
+        bounds[rightIdx][TREE_BOUNDING_BOX_LOCATION_X + splitAxis] = splitPos;
+        bounds[rightIdx][TREE_BOUNDING_BOX_SIZE_X + splitAxis] = bounds[nodeIdx][TREE_BOUNDING_BOX_SIZE_X + splitAxis] - bounds[leftIdx][TREE_BOUNDING_BOX_SIZE_X + splitAxis];
+        
+        entry = pushStack(stack);
+        entry[0] = nodeIdx;
+        entry[1] = depth;
+        entry[2] = 1;
+        entry = pushStack(stack);
+        entry[0] = rightIdx;
+        entry[1] = depth + 1;
+        entry[2] = 0;
+        entry = pushStack(stack);
+        entry[0] = leftIdx;
+        entry[1] = depth + 1;
+        entry[2] = 0;
+    }
+    
+    summary->sahCost = costs[0];
+    
+    free(bounds);
+    free(costs);
+    free(seen);
+    return 1;
+}
+
+// Worker thread for the tree comparison. Each task is a whole tree.
+void *_childCompareTrees(void *arg)
+{
+    TreeComparisonEngine *engine = (TreeComparisonEngine *) arg;
+    TraversalStack stack;
+    int task, success = 1;
+    
+    initialiseStack(&stack, 3);
+    
+    while ((task = __sync_fetch_and_add(&engine->nextTask, 1)) < engine->noTasks)
+    {
+        if (!summariseTree(&engine->trees[task], &engine->summaries[task], &stack))
+            success = 0;
+    }
+    
+    freeStack(&stack);
+    return success ? (void *) 1 : (void *) 0;
+}
+
+// Summarises every loaded tree, each on its own thread. Returns 0 if that failed.
+int CompareTrees(void)
+{
+    TreeComparisonEngine engine;
+    
+    engine.trees = Trees;
+    engine.summaries = TreeSummaries;
+    engine.noTasks = noTrees;
+    engine.nextTask = 0;
+    
+    if (!runWorkerThreads(_childCompareTrees, &engine, engine.noTasks))
+    {
+        printf("ERROR: Unable to allocate memory for the tree comparison.\n\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Prints the comparison of the first two trees, with the second's difference from the first.
+void printTreeComparison(void)
+{
+    static const char *bucketNames[LEAF_OCCUPANCY_BUCKETS] = {"0", "1", "2-3", "4-7", "8-15", "16-31", "32+"};
+    TreeSummary *a = &TreeSummaries[0], *b = &TreeSummaries[1];
+    int n, depthA, depthB;
+    
+    printf("Tree comparison (A: \"%s\", B: \"%s\"):\n", Trees[0].filename, Trees[1].filename);
+    printf("    %-24s %12s %12s %12s\n", "", "A", "B", "B - A");
+    printf("    %-24s %12i %12i %+12i\n", "Nodes", a->noNodes, b->noNodes, b->noNodes - a->noNodes);
+    printf("    %-24s %12i %12i %+12i\n", "Depth", a->noDepthLevels, b->noDepthLevels, b->noDepthLevels - a->noDepthLevels);
+    printf("    %-24s %12i %12i %+12i\n", "Leaves", a->noLeaves, b->noLeaves, b->noLeaves - a->noLeaves);
+    printf("    %-24s %12i %12i %+12i\n", "Empty leaves", a->noEmptyLeaves, b->noEmptyLeaves, b->noEmptyLeaves - a->noEmptyLeaves);
+    printf("    %-24s %12i %12i %+12i\n", "Most leaf primitives", a->maxLeafPrimitives, b->maxLeafPrimitives, b->maxLeafPrimitives - a->maxLeafPrimitives);
+    printf("    %-24s %12lli %12lli %+12lli\n", "Primitive references", a->noReferences, b->noReferences, b->noReferences - a->noReferences);
+    printf("    %-24s %12lli %12lli %+12lli\n", "Duplicated references", a->noReferences - a->noUniquePrimitives, b->noReferences - b->noUniquePrimitives, (b->noReferences - b->noUniquePrimitives) - (a->noReferences - a->noUniquePrimitives));
+    printf("    %-24s %12.4f %12.4f %+12.4f\n", "SAH cost", a->sahCost, b->sahCost, b->sahCost - a->sahCost);
+    
+    printf("  Leaves by primitive count:\n");
+    for (n = 0; n < LEAF_OCCUPANCY_BUCKETS; n++)
+        printf("    %-24s %12i %12i %+12i\n", bucketNames[n], a->leafOccupancy[n], b->leafOccupancy[n], b->leafOccupancy[n] - a->leafOccupancy[n]);
+    
+    printf("  Nodes by depth:\n");
+    for (n = 0; n < a->noDepthLevels || n < b->noDepthLevels; n++)
+    {
+        depthA = (n < a->noDepthLevels) ? a->depthCounts[n] : 0;
+        depthB = (n < b->noDepthLevels) ? b->depthCounts[n] : 0;
+        printf("    %-24i %12i %12i %+12i\n", n, depthA, depthB, depthB - depthA);
+    }
+    printf("\n");
+}
+
+// Marks the sub windows affected by the given reasons as dirty and schedules a redraw of
+// only those windows. Repeated requests before a window is drawn are merged.
+void requestRedraw(int reasons)
+{
+    if ((reasons & REDRAW_TREE_VIEW) && treeSubWindow)
+    {
+        if (!TreeViewDirty)
+            glutPostWindowRedisplay(treeSubWindow);
+        TreeViewDirty |= reasons & REDRAW_TREE_VIEW;
+    }
+    if ((reasons & REDRAW_SCENE_VIEW) && sceneSubWindow)
+    {
+        if (!SceneViewDirty)
+            glutPostWindowRedisplay(sceneSubWindow);
+        SceneViewDirty |= reasons & REDRAW_SCENE_VIEW;
+    }
+}
+
+// Moves the camera at the target frame rate for as long as a movement key is held.
+void movementTimerFunc(int value)
+{
+    (void) value;
+    
+    if (deltaMoveFB || deltaMoveLR || deltaMoveUD)
+    {
+        computeScenePosition();
+        requestRedraw(REDRAW_CAMERA_MOVED);
+        glutTimerFunc(1000 / TARGET_FRAME_RATE, movementTimerFunc, 0);
+    }
+    else
+        MovementTimerActive = 0;
+}
+
+// Publishes the stage the tree loader has reached, for the render thread to pick up.
+void publishLoadingStage(int stage)
+{
+    pthread_mutex_lock(&Loading.lock);
+    Loading.stage = stage;
+    pthread_mutex_unlock(&Loading.lock);
+}
+
+// Publishes every triangle decoded so far as ready to be drawn.
+void publishTrianglesReady(void)
+{
+    pthread_mutex_lock(&Loading.lock);
+    Loading.noTrianglesReady = noTriangles;
+    pthread_mutex_unlock(&Loading.lock);
+}
+
+// Loads the trees and works out everything the views need from the first of them. Each stage
+// is published once it's finished, and nothing it made is written to again after that.
+void *_childLoadTrees(void *arg)
+{
+    int n;
+    
+    (void) arg;
+    
+    // The first tree is the one that's shown:
+    for (n = 0; n < noTrees; n++)
+        LoadTree(TreeFilenames[n], &Trees[n]);
+    useTree(&Trees[0]);
+    publishLoadingStage(LOADING_COUNTERS);
+    
+    // Now begin by computing the tree stats. Start by initialising counters:
+    printf("Initialising depth and node counters... ");
+    initialiseTreeDepthCounter();
+    initialiseTreeNodeCounter();
+    printf("Done.\n");
+    
+    // Then populate the depth and node counters in one pass
+    printf("Populating depth and node counters... ");
+    populateTreeStatistics();
+    printf("Done.\n\n");
+    publishLoadingStage(LOADING_LAYOUT);
+    
+    // The tree view layout only depends on the depth counts. There's no view when headless:
+    if (!HeadlessMode)
+    {
+        printf("Laying out tree view... ");
+        computeTreeLayout();
+        buildTreeGeometry();
+        printf("Done.\n\n");
+    }
+    publishLoadingStage(LOADING_BOXES);
+    
+    // Work out where every node sits in the scene and build its box:
+    printf("Building node boxes... ");
+    computeNodeBounds();
+    if (!HeadlessMode)
+        buildBoxGeometry();
+    printf("Done.\n\n");
+    publishLoadingStage(LOADING_COSTS);
+    
+    // Then cost the tree from the bounds and the primitive counts:
+    printf("Computing SAH costs... ");
+    computeNodeCosts();
+    printf("Done.\n");
+    printf("Tree SAH cost: %f (traversal %f, intersection %f)\n\n", NodeCosts[0], SAHTraversalCost, SAHIntersectionCost);
+    publishLoadingStage(LOADING_COMPARISON);
+    
+    if (noTrees > 1)
+    {
+        printf("Comparing trees... ");
+        if (!CompareTrees())
+            exit(-1);
+        printf("Done.\n");
+        printTreeComparison();
+    }
+    publishLoadingStage(LOADING_DONE);
+    
+    return (void *) 1;
+}
+
+// Loads the scenery given with -scene, if there was one, and publishes that it's done. The
+// triangles themselves are published by LoadScenery as they're decoded.
+void *_childLoadScenery(void *arg)
+{
+    int loaded = 0;
+    
+    (void) arg;
+    
+    // Has the scenery filename been defined?
+    if (SceneFilename)
+    {
+        // Yes, then load the scenery file.
+        loaded = LoadScenery(SceneFilename);
+        if (!loaded)
+            printf("WARNING: Unable to load the scenery file \"%s\". Verify that it exists and is valid.\n\n", SceneFilename);
+        else
+            publishTrianglesReady();
+    }
+    
+    pthread_mutex_lock(&Loading.lock);
+    // Whatever was streamed before a failure is only part of the scene, so take it back:
+    if (!loaded)
+        Loading.noTrianglesReady = 0;
+    Loading.sceneryLoaded = loaded;
+    Loading.sceneryDone = 1;
+    pthread_mutex_unlock(&Loading.lock);
+    
+    return (void *) 1;
+}
+
+// Starts loading the trees and the scenery in the background so that the window can show
+// them as they come in. Either is loaded here and now if its thread can't be started.
+void startLoaders(void)
+{
+    pthread_t thread;
+    
+    if (pthread_create(&thread, NULL, _childLoadTrees, NULL) == 0)
+        pthread_detach(thread);
+    else
+        _childLoadTrees(NULL);
+    
+    if (pthread_create(&thread, NULL, _childLoadScenery, NULL) == 0)
+        pthread_detach(thread);
+    else
+        _childLoadScenery(NULL);
+    
+    glutTimerFunc(LOADING_POLL_INTERVAL, loadingTimerFunc, 0);
+}
+
+// Picks up the loaders' progress for the render thread and redraws whatever it changes. Keeps
+// checking until both the tree and the scenery are in.
+void loadingTimerFunc(int value)
+{
+    int stage, noTrianglesReady, sceneryDone, sceneryLoaded;
+    
+    (void) value;
+    
+    pthread_mutex_lock(&Loading.lock);
+    stage = Loading.stage;
+    noTrianglesReady = Loading.noTrianglesReady;
+    sceneryDone = Loading.sceneryDone;
+    sceneryLoaded = Loading.sceneryLoaded;
+    pthread_mutex_unlock(&Loading.lock);
+    
+    if (stage != ViewLoadingStage)
+    {
+        ViewLoadingStage = stage;
+        // The first node starts off selected once there's a box and a cost to show for it:
+        if (stage == LOADING_DONE)
+            selectNode(0);
+        requestRedraw(REDRAW_TREE_RELOADED);
+    }
+    if (noTrianglesReady != ViewTrianglesReady || sceneryDone != ViewSceneryDone)
+    {
+        ViewTrianglesReady = noTrianglesReady;
+        ViewSceneryDone = sceneryDone;
+        SceneryLoaded = sceneryLoaded;
+        requestRedraw(REDRAW_SCENERY_STREAMED);
+    }
+    
+    if (!loadingFinished())
+        glutTimerFunc(LOADING_POLL_INTERVAL, loadingTimerFunc, 0);
+}
+
+// Whether the tree and the scenery are both in, as far as the render thread knows.
+int loadingFinished(void)
+{
+    return ViewLoadingStage == LOADING_DONE && ViewSceneryDone;
+}
+
+// Main window display function. The sub windows are redrawn by their own display functions
+// when they're exposed or marked dirty.
+void mainWindowRenderer(void)
+{
+    glutSetWindow(mainWindow);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glutSwapBuffers();
+}
+
+// Main window reshape function
+void reshapeFunc(int newWidth, int newHeight)
+{
+    // Always force the size to be set to defaults
+    glutReshapeWindow(SCREEN_WIDTH, SCREEN_HEIGHT);
+    glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    glMatrixMode(GL_PROJECTION);  
+    glLoadIdentity();  
+    gluOrtho2D(0, SCREEN_WIDTH, SCREEN_HEIGHT, 0);  
+    glMatrixMode(GL_MODELVIEW);  
+    glLoadIdentity();  
+}
+
+// Main window idle function
+void idleFunc(void)
+{
+    glutPostRedisplay();
+}
+
+// Tree sub window display function
+void treeSubWindowRenderer(void)
+{
+    glutSetWindow(treeSubWindow);
+    
+    // Clear information from last draw:
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // Switch to drawing mode
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    
+    gluOrtho2D(-TREE_VIEW_MARGIN, TREE_VIEW_WIDTH - TREE_VIEW_MARGIN, -TREE_VIEW_HEIGHT + TREE_VIEW_MARGIN, TREE_VIEW_MARGIN);
+    // gluPerspective(90.0, 0.625, 3.0, 200.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    // gluLookAt(40, -40, 70, 40, -40, 0, 0, 1, 0);
+    if (ShowTreeComparison)
+    {
+        DrawTreeComparison();
+    }
+    else
+    {
+        // The tree can be drawn as soon as it's been laid out:
+        if (ViewLoadingStage >= LOADING_BOXES)
+            DrawTree();
+        DisplayNodeInfo();
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    // Finally, swap buffers:
+    glutSwapBuffers();
+    TreeViewDirty = 0;
+}
+
+// Scene sub window display function
+void sceneSubWindowRenderer(void)
+{
+    glutSetWindow(sceneSubWindow);
+    
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // Switch to drawing mode
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluPerspective(SCENE_VIEW_FOV, SCENE_VIEW_ASPECT, SCENE_VIEW_NEAR, SCENE_VIEW_FAR);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    gluLookAt(x, y, z, x + lx, y + ly, z + lz, 0, 1, 0);
+    if (ShowRayHeatmap)
+    {
+        DrawRayCostImage();
+    }
+    else
+    {
+        // Take in whatever scenery has arrived since the last frame. The scene can only be
+        // culled and the boxes drawn once the tree is in:
+        streamSceneBuffers();
+        if (ViewLoadingStage == LOADING_DONE)
+            cullSceneToFrustum();
+        DrawScene();
+        if (ViewLoadingStage == LOADING_DONE)
+            DrawBoxes();
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    DisplaySceneryProgress();
+    
+    // Finally, swap buffers:
+    glutSwapBuffers();
+    SceneViewDirty = 0;
+}
+
+// function to initialise GLUT window and output
+void initialiseGLUT(int argc, char *argv[])
+{
+    glutInitWindowSize(SCREEN_WIDTH, SCREEN_HEIGHT);
+    
+    // Set up the window position:
+    glutInitWindowPosition(0, 0);
+    glutInitDisplayMode(GLUT_RGBA | GLUT_ALPHA | GLUT_DOUBLE | GLUT_DEPTH);
     
     printf("Initialising GLUT... ");
     glutInit(&argc, argv);
     printf("Done\n");
     
-    mainWindow = glutCreateWindow("Tree Analyser");
+    mainWindow = glutCreateWindow("Tree Analyser");
+    
+    // Attach renderers to the main window
+    glutDisplayFunc(mainWindowRenderer);
+    glutReshapeFunc(reshapeFunc);
+    // glutIdleFunc(idleFunc);
+    // Then initialise UI elements
+    initUI();
+    
+    treeSubWindow = glutCreateSubWindow(mainWindow, BORDER_SIZE, BORDER_SIZE, TREE_VIEW_WIDTH, TREE_VIEW_HEIGHT);
+    
+    // Attach renderers to the tree sub window
+    glutDisplayFunc(treeSubWindowRenderer);
+    // Then initialise UI elements
+    initTreeUI();
+    
+    sceneSubWindow  = glutCreateSubWindow(mainWindow, SCREEN_WIDTH / 3 + BORDER_SIZE / 2, BORDER_SIZE, 2 * (SCREEN_WIDTH / 3) - BORDER_SIZE, SCREEN_HEIGHT - 2 * BORDER_SIZE);
+    
+    // Attach renderers to the scene sub window
+    glutDisplayFunc(sceneSubWindowRenderer);
+    // Then initialise UI elements
+    initUI();
+    // glLoadIdentity();
+    // glOrtho(0.0, SCREEN_WIDTH - 1.0, 0.0, SCREEN_HEIGHT - 1.0, -1.0,  1.0);
+}
+
+// Common UI elements are initialised within this function
+void initUI()
+{
+    GLfloat ambientLight[4] = {0.3, 0.3, 0.3, 1.0};
+    GLfloat diffuseLight[4] = {0.7, 0.7, 0.7, 1.0};
+    
+    // Enable lighting
+    glEnable(GL_LIGHTING);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
+    glEnable(GL_LIGHT0);
+    
+    glEnable(GL_COLOR_MATERIAL);
+    
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    // glEnable(GL_BLEND);
+    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    glDepthFunc(GL_LEQUAL);
+    
+    glutIgnoreKeyRepeat(1);
+    glutKeyboardFunc(keyboardFunc);
+    glutSpecialFunc(specialFunc);
+    glutSpecialUpFunc(specialReleaseFunc);
+    glutMouseFunc(mouseFunc);
+    glutMotionFunc(mouseMoveFunc);
+}
+
+void initTreeUI()
+{
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    // glEnable(GL_BLEND);
+    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    glutIgnoreKeyRepeat(1);
+    glutKeyboardFunc(keyboardFunc);
+    glutSpecialFunc(specialFunc);
+    glutSpecialUpFunc(specialReleaseFunc);
+    // Mouse functions are different
+    glutMouseFunc(mouseTreeFunc);
+    glutMotionFunc(mouseMoveTreeFunc);
+}
+
+// Keyboard key capture
+void keyboardFunc(unsigned char key, int xmouse, int ymouse)
+{
+    if (key == ESCAPE_KEY)
+    {
+        glutDestroyWindow(mainWindow);
+        exit(0);
+    }
+    else if (key == 'r')
+    {
+        // Cast rays from where the camera is now and show the results:
+        if (!loadingFinished())
+            printf("WARNING: Rays can't be cast until the tree and scenery have loaded.\n\n");
+        else if (CastRays())
+        {
+            ShowRayHeatmap = 1;
+            TreeColoursStale = 1;
+            requestRedraw(REDRAW_RAYS_CAST);
+        }
+    }
+    else if (key == 'p')
+    {
+        // Switch between casting packets of rays and single rays:
+        RayCastPackets = !RayCastPackets;
+        printf("Ray caster now casts %s.\n\n", RayCastPackets ? "packets of rays" : "single rays");
+    }
+    else if (key == 'h' && RaysCast)
+    {
+        // Toggle between the heatmap and the normal views:
+        ShowRayHeatmap = !ShowRayHeatmap;
+        TreeColoursStale = 1;
+        requestRedraw(REDRAW_RAYS_CAST);
+    }
+    else if (key == 'c' && noTrees > 1 && ViewLoadingStage == LOADING_DONE)
+    {
+        // Swap the tree view for the comparison panel and back:
+        ShowTreeComparison = !ShowTreeComparison;
+        requestRedraw(REDRAW_PANEL_TOGGLED);
+    }
+    else if (key == 'f' && ViewLoadingStage >= LOADING_BOXES)
+    {
+        // Zoom the tree view out to show the whole tree:
+        fitTreeView();
+        requestRedraw(REDRAW_TREE_VIEW_MOVED);
+    }
+}
+
+// Keyboard special key capture
+void specialFunc(int key, int xmouse, int ymouse)
+{
+    switch(key)
+    {
+        case GLUT_KEY_UP:
+            deltaMoveFB = 0.5;
+            break;
+        case GLUT_KEY_DOWN:
+            deltaMoveFB = -0.5;
+            break;
+        case GLUT_KEY_LEFT:
+            deltaMoveLR = -5.0;
+            break;
+        case GLUT_KEY_RIGHT:
+            deltaMoveLR = 5.0;
+            break;
+        case GLUT_KEY_PAGE_UP:
+            deltaMoveUD = 1.0;
+            break;
+        case GLUT_KEY_PAGE_DOWN:
+            deltaMoveUD = -1.0;
+            break;
+    }
+    
+    // Start moving the camera if it isn't already:
+    if ((deltaMoveFB || deltaMoveLR || deltaMoveUD) && !MovementTimerActive)
+    {
+        MovementTimerActive = 1;
+        glutTimerFunc(0, movementTimerFunc, 0);
+    }
+}
+
+// Keyboard special release keys capture
+void specialReleaseFunc(int key, int xmouse, int ymouse)
+{
+    switch(key)
+    {
+        case GLUT_KEY_UP:
+        case GLUT_KEY_DOWN:
+            deltaMoveFB = 0;
+            break;
+        case GLUT_KEY_LEFT:
+        case GLUT_KEY_RIGHT:
+            deltaMoveLR = 0;
+            break;
+        case GLUT_KEY_PAGE_UP:
+        case GLUT_KEY_PAGE_DOWN:
+            deltaMoveUD = 0;
+            break;
+    }
+}
+
+// Mouse button capture.
+void mouseFunc(int button, int state, int xmouse, int ymouse)
+{
+    if (button == GLUT_RIGHT_BUTTON)
+    {
+        // Check if the button was released:
+        if (state == GLUT_UP)
+        {
+            angleX += deltaAngleX;
+            angleY += deltaAngleY;
+            
+            xOrigin = -1;
+            yOrigin = -1;
+        }
+        else
+        {
+            xOrigin = xmouse;
+            yOrigin = ymouse;
+        }
+    }
+    else if (button == GLUT_LEFT_BUTTON)
+    {
+        // Select whichever leaf holds the triangle under the mouse:
+        if (state == GLUT_UP && loadingFinished() && PickScene(xmouse, ymouse) >= 0)
+            requestRedraw(REDRAW_SELECTION_CHANGED);
+    }
+}
+
+// Mouse movement capture.
+void mouseMoveFunc(int xmouse, int ymouse)
+{
+    // If the xOrigin is positive then the right mouse button is held down:
+    if (xOrigin >= 0)
+    {
+        // Update the deltaAngle:
+        deltaAngleX = (xmouse - xOrigin) * 0.001;
+        deltaAngleY = (ymouse - yOrigin) * 0.001;
+        
+        lx = sin(angleY + deltaAngleY) * cos(angleX + deltaAngleX);
+        ly = cos(angleY + deltaAngleY);
+        lz = sin(angleY + deltaAngleY) * sin(angleX + deltaAngleX);
+        
+        requestRedraw(REDRAW_CAMERA_MOVED);
+    }
+}
+
+void mouseTreeFunc(int button, int state, int xmouse, int ymouse)
+{
+    int n;
+    
+    // There's nothing to move around until the tree view has been laid out:
+    if (ViewLoadingStage < LOADING_BOXES)
+        return;
+    
+    if (button == GLUT_LEFT_BUTTON && !ShowTreeComparison)
+    {
+        // Nodes can only be picked once their boxes and costs are in:
+        if (state == GLUT_UP && ViewLoadingStage == LOADING_DONE)
+        {
+            // Undo the tree view's projection and then its pan and zoom:
+            n = treeNodeAt(TreeViewOrigin[0] + ((float) xmouse - TREE_VIEW_MARGIN) / TreeViewZoom,
+                           TreeViewOrigin[1] + (TREE_VIEW_MARGIN - (float) ymouse) / TreeViewZoom);
+            if (n < 0)
+                return;
+            
+            selectNode(n);
+            requestRedraw(REDRAW_SELECTION_CHANGED);
+        }
+    }
+    else if (button == GLUT_RIGHT_BUTTON)
+    {
+        // Holding the right button down drags the tree around:
+        TreeViewPanX = (state == GLUT_DOWN) ? xmouse : -1;
+        TreeViewPanY = (state == GLUT_DOWN) ? ymouse : -1;
+    }
+    else if ((button == MOUSE_WHEEL_UP || button == MOUSE_WHEEL_DOWN) && state == GLUT_DOWN && !ShowTreeComparison)
+    {
+        zoomTreeView(xmouse, ymouse, (button == MOUSE_WHEEL_UP) ? TREE_VIEW_ZOOM_STEP : 1.0 / TREE_VIEW_ZOOM_STEP);
+        requestRedraw(REDRAW_TREE_VIEW_MOVED);
+    }
+}
+
+// Tree view mouse movement capture.
+void mouseMoveTreeFunc(int xmouse, int ymouse)
+{
+    if (TreeViewPanX >= 0 && !ShowTreeComparison)
+    {
+        TreeViewOrigin[0] -= (float) (xmouse - TreeViewPanX) / TreeViewZoom;
+        TreeViewOrigin[1] += (float) (ymouse - TreeViewPanY) / TreeViewZoom;
+        TreeViewPanX = xmouse;
+        TreeViewPanY = ymouse;
+        requestRedraw(REDRAW_TREE_VIEW_MOVED);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    char *currObj, *parVal = "";
+    int isParam, i, n, a;
+    
+    // Headless runs may be writing their statistics to stdout, so this has to be known before
+    // anything else is printed:
+    for (i = 1; i < argc; i++)
+        if (argv[i][0] == '-' && !strcmp(argv[i] + strspn(argv[i], "-"), "headless"))
+            HeadlessMode = 1;
+    if (HeadlessMode)
+    {
+        n = dup(STDOUT_FILENO);
+        if (n < 0 || !(StatsOutput = fdopen(n, "w")) || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            printf("ERROR: Unable to keep stdout for the statistics.\n\n");
+            exit(-1);
+        }
+    }
+    
+    printf("\nTreeAnalyser ");
+    printf("Version: %i.%i.%i (%s)\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
+    printf("Author: Andrew Hills (a.hills@sheffield.ac.uk)\n\n");
+    
+    for (i = 1; i < argc; i++)
+    {
+        currObj = argv[i];
+        isParam = 0;
+        a = strlen(argv[i]);
+        for (n = 0; n < a; n++)
+        {
+            if (argv[i][n] == '-')
+                isParam = 1;
+            else
+                break;
+        }
+        if (isParam)
+        {
+            memmove(&currObj[0], &currObj[n], strlen(currObj) - n + 1);
+            parVal = currObj;
+            
+            // Switches don't take a value:
+            if (!strcmp(parVal, "headless"))
+            {
+                HeadlessMode = 1;
+                parVal = "";
+            }
+            else if (!strcmp(parVal, "benchmark"))
+            {
+                BenchmarkMode = 1;
+                parVal = "";
+            }
+        }
+        else
+        {
+            if (strcmp(parVal, ""))
+            {
+                if (!strcmp(parVal, "tree"))
+                {
+                    // Read in the tree filename. Any after the first are compared with it.
+                    if (noTrees < MAX_COMPARED_TREES)
+                        TreeFilenames[noTrees++] = currObj;
+                    else
+                        printf("Only %i trees can be compared, ignoring \"%s\"\n\n", MAX_COMPARED_TREES, currObj);
+                }
+                else if (!strcmp(parVal, "scene"))
+                {
+                    // Read in the scene filename
+                    SceneFilename = currObj;
+                }
+                else if (!strcmp(parVal, "cache"))
+                {
+                    // Read in the scene cache filename
+                    SceneCacheFilename = currObj;
+                }
+                else if (!strcmp(parVal, "convert"))
+                {
+                    // Read in the compact tree filename
+                    ConvertFilename = currObj;
+                }
+                else if (!strcmp(parVal, "traversal"))
+                {
+                    // Read in the SAH traversal cost
+                    SAHTraversalCost = atof(currObj);
+                }
+                else if (!strcmp(parVal, "intersection"))
+                {
+                    // Read in the SAH intersection cost
+                    SAHIntersectionCost = atof(currObj);
+                }
+                else if (!strcmp(parVal, "fov"))
+                {
+                    // Read in the ray caster's vertical field of view
+                    RayCastFoV = atof(currObj);
+                }
+                else if (!strcmp(parVal, "camera"))
+                {
+                    // Read in the camera position and view direction
+                    if (sscanf(currObj, "%f,%f,%f,%f,%f,%f", &x, &y, &z, &lx, &ly, &lz) != 6)
+                        printf("Camera should be given as x,y,z,lx,ly,lz\n\n");
+                }
+                else if (!strcmp(parVal, "output"))
+                {
+                    // Read in the statistics filename
+                    StatsFilename = currObj;
+                }
+                else if (!strcmp(parVal, "format"))
+                {
+                    // Read in the statistics format
+                    if (!strcmp(currObj, "json"))
+                        StatsFormat = STATS_FORMAT_JSON;
+                    else if (!strcmp(currObj, "csv"))
+                        StatsFormat = STATS_FORMAT_CSV;
+                    else
+                        printf("Unrecognised statistics format \"%s\"\n\n", currObj);
+                }
+                else
+                {
+                    printf("Unrecognised input \"%s\"\n\n", parVal);
+                }
+            }
+        }
+    }
+    
+    // Check the tree variable for assignment.
+    if (noTrees == 0)
+    {
+        // It wasn't assigned to anything.
+        printf("ERROR: Tree filename needs to be specified.\n\n");
+        exit(-1);
+    }
     
-    // Attach renderers to the main window
-    glutDisplayFunc(mainWindowRenderer);
-    glutReshapeFunc(reshapeFunc);
-    // glutIdleFunc(idleFunc);
-    // Then initialise UI elements
-    initUI();
+    // Converting only needs the tree itself:
+    if (ConvertFilename)
+    {
+        LoadTree(TreeFilenames[0], &Trees[0]);
+        useTree(&Trees[0]);
+        return WriteCompactTree(ConvertFilename, &Trees[0]) ? 0 : -1;
+    }
+    
+    // Headless and benchmark runs have nothing to show, so they load everything up front and
+    // finish once the results are out:
+    if (HeadlessMode || BenchmarkMode)
+    {
+        _childLoadTrees(NULL);
+        _childLoadScenery(NULL);
+        SceneryLoaded = Loading.sceneryLoaded;
+        
+        // Batch runs need to be able to tell that the scene they asked for is missing:
+        if (HeadlessMode && SceneFilename && !SceneryLoaded)
+        {
+            printf("ERROR: The scenery file \"%s\" didn't load, so no statistics were written.\n\n", SceneFilename);
+            exit(-1);
+        }
+        
+        if (BenchmarkMode && !RunRayBenchmark())
+            exit(-1);
+        if (HeadlessMode && !WriteTreeStatistics(TreeFilenames[0], SceneFilename))
+            exit(-1);
+        return 0;
+    }
+    
+    initialiseGLUT(argc, argv);
+    
+    // The window opens straight away and fills in as the trees and the scenery load:
+    startLoaders();
+    
+    // glEnable(GL_DEPTH_TEST);
+    
+    glutMainLoop();
+    
+    return 1;
+}
+
+// Function to load a tree file into a tree context. The file is mapped rather than read so
+// that only the pages of the populated entries are ever faulted in.
+void LoadTree(char *filename, TreeContext *tree)
+{
+    int fd, *header;
+    struct stat fileStats;
+    size_t offset, required;
+    
+    printf("Restoring tree to memory...\n");
+    
+    // Open the file for reading
+    fd = open(filename, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        // Invalid file
+        printf("ERROR: Unable to open \"%s\" for reading.\n\n", filename);
+        exit(-100);
+    }
+    
+    // Make sure there's at least a header to read:
+    if (fstat(fd, &fileStats) < 0 || fileStats.st_size < (off_t) (sizeof(int) * TREE_FILE_HEADER_SIZE))
+    {
+        printf("ERROR: \"%s\" is too small to be a tree file.\n\n", filename);
+        close(fd);
+        exit(-100);
+    }
+    
+    // Map the whole file. The descriptor isn't needed once the mapping exists.
+    tree->mappingSize = (size_t) fileStats.st_size;
+    tree->mapping = mmap(NULL, tree->mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (tree->mapping == MAP_FAILED)
+    {
+        printf("ERROR: Unable to map \"%s\" to memory.\n\n", filename);
+        tree->mapping = NULL;
+        exit(-100);
+    }
+    
+    // Compact files are decoded rather than used in place:
+    if (*(uint32_t *) tree->mapping == TREE_FILE_MAGIC)
+    {
+        loadCompactTree(filename, tree);
+        tree->filename = filename;
+        printf("Tree state restored from \"%s\".\n\n", filename);
+        return;
+    }
+    
+    // If here, the file was mapped successfully. Now start reading:
+    header = (int *) tree->mapping;
+    memcpy(tree->boundingBox, header, sizeof(int) * TREE_BOUNDING_BOX_ARRAY_SIZE);
+    
+    // Then load constants:
+    tree->splitListTop = header[TREE_BOUNDING_BOX_ARRAY_SIZE];
+    tree->noSplitListEntries = header[TREE_BOUNDING_BOX_ARRAY_SIZE + 1];
+    tree->noTreeListEntries = header[TREE_BOUNDING_BOX_ARRAY_SIZE + 2];
+    tree->noTreeMatrixEntries = header[TREE_BOUNDING_BOX_ARRAY_SIZE + 3];
+    tree->noNodeListEntries = header[TREE_BOUNDING_BOX_ARRAY_SIZE + 4];
+    
+    if (tree->noTreeMatrixEntries <= 0 || tree->noTreeListEntries < 0 || tree->noNodeListEntries < 0)
+    {
+        printf("ERROR: \"%s\" has an invalid tree header.\n\n", filename);
+        exit(-100);
+    }
+    
+    // Now point the views at each section. The tree matrix and tree list are stored
+    // populated-only, whereas the split list and node list are stored at full capacity.
+    offset = TREE_FILE_HEADER_SIZE;
+    tree->treeMatrix = (int (*)[TREE_MATRIX_SIZE]) (header + offset);
+    offset += (size_t) tree->noTreeMatrixEntries * TREE_MATRIX_SIZE;
+    
+    tree->treeList = (int (*)[TREE_LIST_SIZE]) (header + offset);
+    offset += (size_t) tree->noTreeListEntries * TREE_LIST_SIZE;
+    
+    tree->splitList = (int (*)[SPLIT_LIST_SIZE]) (header + offset);
+    offset += (size_t) TREE_FILE_SPLIT_LIST_ENTRIES * SPLIT_LIST_SIZE;
+    
+    tree->nodeList = (int (*)[NODE_LIST_SIZE]) (header + offset);
+    
+    // Only the populated part of the node list needs to be present:
+    required = offset + (size_t) tree->noNodeListEntries * NODE_LIST_SIZE;
+    if (required * sizeof(int) > tree->mappingSize)
+    {
+        printf("ERROR: \"%s\" is truncated (%lu bytes, expected at least %lu).\n\n", filename, (unsigned long) tree->mappingSize, (unsigned long) (required * sizeof(int)));
+        exit(-100);
+    }
+    
+    buildLeafPrimitiveArrays(tree);
+    tree->filename = filename;
+    
+    printf("Tree state restored from \"%s\".\n\n", filename);
+}
+
+// Flattens the node list chains into contiguous per-leaf primitive arrays, then hands
+// the node list pages of the mapping back to the kernel. Nothing reads the node list after this.
+void buildLeafPrimitiveArrays(TreeContext *tree)
+{
+    int nodeIdx, listIdx, steps, capacity;
+    long pageSize;
+    uintptr_t start, end;
+    
+    free(tree->leafPrimitiveOffsets);
+    free(tree->leafPrimitives);
+    
+    // Each node list entry normally belongs to exactly one leaf, so that's the starting capacity:
+    capacity = tree->noNodeListEntries > 0 ? tree->noNodeListEntries : 1;
+    tree->leafPrimitiveOffsets = (int *) malloc(sizeof(int) * (tree->noTreeMatrixEntries + 1));
+    tree->leafPrimitives = (int *) malloc(sizeof(int) * capacity);
+    
+    if (tree->leafPrimitiveOffsets == NULL || tree->leafPrimitives == NULL)
+    {
+        printf("ERROR: Unable to allocate memory for the leaf primitive arrays.\n\n");
+        exit(-1);
+    }
+    
+    // Nodes are visited in order, so each leaf's range starts where the previous one ended.
+    // Junction nodes are given empty ranges.
+    tree->noLeafPrimitives = 0;
+    for (nodeIdx = 0; nodeIdx < tree->noTreeMatrixEntries; nodeIdx++)
+    {
+        tree->leafPrimitiveOffsets[nodeIdx] = tree->noLeafPrimitives;
+        listIdx = tree->treeMatrix[nodeIdx][TREE_MATRIX_LEAF_NODE];
+        
+        // A chain can't be longer than the node list, so anything longer must loop:
+        for (steps = 0; listIdx >= 0; steps++)
+        {
+            if (listIdx >= tree->noNodeListEntries || steps >= tree->noNodeListEntries)
+            {
+                printf("ERROR: Node %i has a malformed primitive list.\n\n", nodeIdx);
+                exit(-100);
+            }
+            
+            if (tree->noLeafPrimitives == capacity)
+            {
+                capacity *= 2;
+                tree->leafPrimitives = (int *) realloc(tree->leafPrimitives, sizeof(int) * capacity);
+                if (tree->leafPrimitives == NULL)
+                {
+                    printf("ERROR: Unable to allocate memory for the leaf primitive arrays.\n\n");
+                    exit(-1);
+                }
+            }
+            
+            tree->leafPrimitives[tree->noLeafPrimitives++] = tree->nodeList[listIdx][NODE_LIST_PRIMITIVE_INDEX];
+            listIdx = tree->nodeList[listIdx][NODE_LIST_NEXT_INDEX];
+        }
+    }
+    tree->leafPrimitiveOffsets[tree->noTreeMatrixEntries] = tree->noLeafPrimitives;
+    
+    // Release the whole pages that only hold the node list:
+    if (tree->mapping != NULL && tree->noNodeListEntries > 0)
+    {
+        pageSize = sysconf(_SC_PAGESIZE);
+        start = ((uintptr_t) tree->nodeList + pageSize - 1) & ~((uintptr_t) pageSize - 1);
+        end = ((uintptr_t) (tree->nodeList + tree->noNodeListEntries)) & ~((uintptr_t) pageSize - 1);
+        if (end > start)
+            madvise((void *) start, end - start, MADV_DONTNEED);
+    }
+    tree->nodeList = NULL;
+}
+
+// Makes a loaded tree the one that the views, statistics and ray caster work on.
+void useTree(TreeContext *tree)
+{
+    memcpy(SceneBoundingBox, tree->boundingBox, sizeof(int) * TREE_BOUNDING_BOX_ARRAY_SIZE);
+    TreeMatrix = tree->treeMatrix;
+    TreeList = tree->treeList;
+    SplitList = tree->splitList;
+    NodeList = tree->nodeList;
+    SplitListTop = tree->splitListTop;
+    noSplitListEntries = tree->noSplitListEntries;
+    noTreeListEntries = tree->noTreeListEntries;
+    noTreeMatrixEntries = tree->noTreeMatrixEntries;
+    noNodeListEntries = tree->noNodeListEntries;
+    LeafPrimitiveOffsets = tree->leafPrimitiveOffsets;
+    LeafPrimitives = tree->leafPrimitives;
+    noLeafPrimitives = tree->noLeafPrimitives;
+}
+
+// Zigzag coding keeps small negative numbers small once they're written as varints.
+#define ZIGZAG_ENCODE(value)                    (((uint32_t) (value) << 1) ^ (uint32_t) ((int32_t) (value) >> 31))
+#define ZIGZAG_DECODE(value)                    ((int32_t) (((value) >> 1) ^ (0U - ((value) & 1))))
+
+// Writes value seven bits at a time, lowest first, with the top bit set on all but the last
+// byte. Returns the number of bytes written.
+int encodeVarint(unsigned char *buffer, uint32_t value)
+{
+    int n = 0;
+    
+    while (value >= 0x80)
+    {
+        buffer[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[n++] = (unsigned char) value;
+    
+    return n;
+}
+
+// Reads a varint and moves the cursor past it. Returns 0 if it runs past the end or is too long.
+int decodeVarint(const unsigned char **cursor, const unsigned char *end, uint32_t *value)
+{
+    const unsigned char *position = *cursor;
+    uint32_t result = 0;
+    int shift;
+    
+    for (shift = 0; shift < VARINT_MAX_BYTES * 7 && position < end; shift += 7)
+    {
+        result |= (uint32_t) (*position & 0x7F) << shift;
+        if (!(*position++ & 0x80))
+        {
+            *value = result;
+            *cursor = position;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Codes a table of ints as zigzag varints. The indexField column, if there is one, holds
+// indices into the table itself and is written relative to the row. Returns the bytes written.
+size_t encodeIntTable(unsigned char *buffer, const int *table, int noEntries, int width, int indexField)
+{
+    size_t size = 0;
+    int n, m, value;
+    
+    for (n = 0; n < noEntries; n++)
+    {
+        for (m = 0; m < width; m++)
+        {
+            value = table[(size_t) n * width + m];
+            if (m == indexField)
+                value -= n;
+            size += encodeVarint(buffer + size, ZIGZAG_ENCODE(value));
+        }
+    }
+    
+    return size;
+}
+
+// Decodes a compact tree file from its mapping into the tree. The node and leaf primitive
+// sections are all that's needed; the builder's tree and split lists are skipped. The
+// mapping is released once the tree has been decoded.
+void loadCompactTree(char *filename, TreeContext *tree)
+{
+    const TreeFileHeader *header = (const TreeFileHeader *) tree->mapping;
+    const TreeFileSection *sections, *nodeSection = NULL, *primitiveSection = NULL;
+    const unsigned char *cursor, *end;
+    uint32_t value;
+    int n, m, axis, count, previous = 0, valid = 1;
+    
+    if (tree->mappingSize < sizeof(TreeFileHeader) || header->version != TREE_FILE_VERSION ||
+        header->fileSize != (uint64_t) tree->mappingSize || header->noSections < 0 || header->noSections > TREE_FILE_MAX_SECTIONS ||
+        sizeof(TreeFileHeader) + sizeof(TreeFileSection) * (size_t) header->noSections > tree->mappingSize ||
+        header->noTreeMatrixEntries <= 0 || header->noLeafPrimitives < 0)
+    {
+        printf("ERROR: \"%s\" isn't a tree file this version can read.\n\n", filename);
+        exit(-100);
+    }
+    
+    sections = (const TreeFileSection *) (header + 1);
+    for (n = 0; n < header->noSections; n++)
+    {
+        if (sections[n].offset > header->fileSize || sections[n].size > header->fileSize - sections[n].offset)
+        {
+            printf("ERROR: \"%s\" is truncated.\n\n", filename);
+            exit(-100);
+        }
+        if (sections[n].type == TREE_SECTION_NODES)
+            nodeSection = &sections[n];
+        else if (sections[n].type == TREE_SECTION_LEAF_PRIMITIVES)
+            primitiveSection = &sections[n];
+    }
+    
+    if (!nodeSection || !primitiveSection || nodeSection->noEntries != (uint32_t) header->noTreeMatrixEntries ||
+        primitiveSection->noEntries != (uint32_t) header->noLeafPrimitives)
+    {
+        printf("ERROR: \"%s\" is missing its nodes or leaf primitives.\n\n", filename);
+        exit(-100);
+    }
+    
+    memcpy(tree->boundingBox, header->boundingBox, sizeof(int) * TREE_BOUNDING_BOX_ARRAY_SIZE);
+    tree->splitListTop = header->splitListTop;
+    tree->noSplitListEntries = header->noSplitListEntries;
+    tree->noTreeListEntries = header->noTreeListEntries;
+    tree->noTreeMatrixEntries = header->noTreeMatrixEntries;
+    tree->noLeafPrimitives = header->noLeafPrimitives;
+    tree->noNodeListEntries = header->noLeafPrimitives;
+    tree->treeList = NULL;
+    tree->splitList = NULL;
+    tree->nodeList = NULL;
+    
+    tree->treeMatrix = (int (*)[TREE_MATRIX_SIZE]) calloc((size_t) tree->noTreeMatrixEntries, sizeof(int) * TREE_MATRIX_SIZE);
+    tree->leafPrimitiveOffsets = (int *) malloc(sizeof(int) * (size_t) (tree->noTreeMatrixEntries + 1));
+    tree->leafPrimitives = (int *) malloc(sizeof(int) * (size_t) (tree->noLeafPrimitives + 1));
+    if (!tree->treeMatrix || !tree->leafPrimitiveOffsets || !tree->leafPrimitives)
+    {
+        printf("ERROR: Unable to allocate memory for the tree.\n\n");
+        exit(-1);
+    }
+    
+    // Nodes are an axis (or the leaf tag), then for junctions the split position and the
+    // children relative to the node and to each other:
+    cursor = (const unsigned char *) tree->mapping + nodeSection->offset;
+    end = cursor + nodeSection->size;
+    for (n = 0; n < tree->noTreeMatrixEntries && valid; n++)
+    {
+        valid = decodeVarint(&cursor, end, &value) && value <= TREE_NODE_LEAF_TAG;
+        axis = (int) value;
+        if (!valid || axis == TREE_NODE_LEAF_TAG)
+            continue;
+        
+        tree->treeMatrix[n][TREE_MATRIX_AXIS_INDEX] = axis;
+        tree->treeMatrix[n][TREE_MATRIX_LEAF_NODE] = -1;
+        valid = decodeVarint(&cursor, end, &value);
+        tree->treeMatrix[n][TREE_MATRIX_SPLIT_POSITION] = ZIGZAG_DECODE(value);
+        valid = valid && decodeVarint(&cursor, end, &value);
+        tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE] = n + ZIGZAG_DECODE(value);
+        valid = valid && decodeVarint(&cursor, end, &value);
+        tree->treeMatrix[n][TREE_MATRIX_RIGHT_NODE] = tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE] + ZIGZAG_DECODE(value);
+        
+        valid = valid && tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE] > 0 && tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE] < tree->noTreeMatrixEntries &&
+            tree->treeMatrix[n][TREE_MATRIX_RIGHT_NODE] > 0 && tree->treeMatrix[n][TREE_MATRIX_RIGHT_NODE] < tree->noTreeMatrixEntries;
+    }
+    
+    // Each leaf, in node order, is a count followed by its primitives, each relative to the last:
+    cursor = (const unsigned char *) tree->mapping + primitiveSection->offset;
+    end = cursor + primitiveSection->size;
+    count = 0;
+    for (n = 0; n < tree->noTreeMatrixEntries && valid; n++)
+    {
+        tree->leafPrimitiveOffsets[n] = count;
+        if (tree->treeMatrix[n][TREE_MATRIX_LEAF_NODE] < 0)
+            continue;
+        
+        // Leaves point at their first primitive, as they would at their node list chain:
+        tree->treeMatrix[n][TREE_MATRIX_LEAF_NODE] = count;
+        valid = decodeVarint(&cursor, end, &value) && value <= (uint32_t) (tree->noLeafPrimitives - count);
+        for (m = 0; valid && m < (int) value; m++)
+        {
+            uint32_t delta = 0;
+            
+            valid = decodeVarint(&cursor, end, &delta);
+            previous += ZIGZAG_DECODE(delta);
+            tree->leafPrimitives[count++] = previous;
+        }
+    }
+    tree->leafPrimitiveOffsets[tree->noTreeMatrixEntries] = count;
+    
+    if (!valid || count != tree->noLeafPrimitives)
+    {
+        printf("ERROR: \"%s\" has a malformed tree.\n\n", filename);
+        exit(-100);
+    }
+    
+    // Everything has been copied out, so the file isn't needed any more:
+    munmap(tree->mapping, tree->mappingSize);
+    tree->mapping = NULL;
+    tree->mappingSize = 0;
+}
+
+// Writes a loaded tree out as a compact tree file. The builder's tree and split lists are kept
+// if the tree still has them. Returns 0 on failure.
+int WriteCompactTree(char *filename, TreeContext *tree)
+{
+    FILE *fp;
+    TreeFileHeader header;
+    TreeFileSection sections[TREE_FILE_MAX_SECTIONS];
+    unsigned char *buffers[TREE_FILE_MAX_SECTIONS];
+    char *temporaryFilename;
+    size_t size, noInts;
+    uint64_t offset;
+    int n, m, noSections = 0, previous = 0, success = 1;
+    
+    memset(&header, 0, sizeof(TreeFileHeader));
+    memset(sections, 0, sizeof(sections));
+    memset(buffers, 0, sizeof(buffers));
+    
+    // Nodes:
+    sections[noSections].type = TREE_SECTION_NODES;
+    sections[noSections].noEntries = tree->noTreeMatrixEntries;
+    buffers[noSections] = (unsigned char *) malloc((size_t) tree->noTreeMatrixEntries * 4 * VARINT_MAX_BYTES);
+    if (buffers[noSections])
+    {
+        size = 0;
+        for (n = 0; n < tree->noTreeMatrixEntries; n++)
+        {
+            if (tree->treeMatrix[n][TREE_MATRIX_LEAF_NODE] >= 0)
+            {
+                size += encodeVarint(buffers[noSections] + size, TREE_NODE_LEAF_TAG);
+                continue;
+            }
+            size += encodeVarint(buffers[noSections] + size, (uint32_t) tree->treeMatrix[n][TREE_MATRIX_AXIS_INDEX]);
+            size += encodeVarint(buffers[noSections] + size, ZIGZAG_ENCODE(tree->treeMatrix[n][TREE_MATRIX_SPLIT_POSITION]));
+            size += encodeVarint(buffers[noSections] + size, ZIGZAG_ENCODE(tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE] - n));
+            size += encodeVarint(buffers[noSections] + size, ZIGZAG_ENCODE(tree->treeMatrix[n][TREE_MATRIX_RIGHT_NODE] - tree->treeMatrix[n][TREE_MATRIX_LEFT_NODE]));
+        }
+        sections[noSections].size = size;
+    }
+    noSections++;
+    
+    // Leaf primitives:
+    sections[noSections].type = TREE_SECTION_LEAF_PRIMITIVES;
+    sections[noSections].noEntries = tree->noLeafPrimitives;
+    buffers[noSections] = (unsigned char *) malloc(((size_t) tree->noTreeMatrixEntries + tree->noLeafPrimitives) * VARINT_MAX_BYTES);
+    if (buffers[noSections])
+    {
+        size = 0;
+        for (n = 0; n < tree->noTreeMatrixEntries; n++)
+        {
+            if (tree->treeMatrix[n][TREE_MATRIX_LEAF_NODE] < 0)
+                continue;
+            size += encodeVarint(buffers[noSections] + size, (uint32_t) (tree->leafPrimitiveOffsets[n + 1] - tree->leafPrimitiveOffsets[n]));
+            for (m = tree->leafPrimitiveOffsets[n]; m < tree->leafPrimitiveOffsets[n + 1]; m++)
+            {
+                size += encodeVarint(buffers[noSections] + size, ZIGZAG_ENCODE(tree->leafPrimitives[m] - previous));
+                previous = tree->leafPrimitives[m];
+            }
+        }
+        sections[noSections].size = size;
+    }
+    noSections++;
+    
+    // The builder's lists, if they're still around:
+    if (tree->treeList)
+    {
+        noInts = (size_t) tree->noTreeListEntries * TREE_LIST_SIZE;
+        sections[noSections].type = TREE_SECTION_TREE_LIST;
+        sections[noSections].noEntries = tree->noTreeListEntries;
+        buffers[noSections] = (unsigned char *) malloc(noInts * VARINT_MAX_BYTES + 1);
+        if (buffers[noSections])
+            sections[noSections].size = encodeIntTable(buffers[noSections], &tree->treeList[0][0], tree->noTreeListEntries, TREE_LIST_SIZE, TREE_LIST_NEXT_INDEX);
+        noSections++;
+    }
+    if (tree->splitList)
+    {
+        noInts = (size_t) tree->noSplitListEntries * SPLIT_LIST_SIZE;
+        sections[noSections].type = TREE_SECTION_SPLIT_LIST;
+        sections[noSections].noEntries = tree->noSplitListEntries;
+        buffers[noSections] = (unsigned char *) malloc(noInts * VARINT_MAX_BYTES + 1);
+        if (buffers[noSections])
+            sections[noSections].size = encodeIntTable(buffers[noSections], &tree->splitList[0][0], tree->noSplitListEntries, SPLIT_LIST_SIZE, SPLIT_LIST_NEXT_INDEX);
+        noSections++;
+    }
+    
+    for (n = 0; n < noSections; n++)
+    {
+        if (!buffers[n])
+        {
+            printf("ERROR: Unable to allocate memory for the compact tree.\n\n");
+            success = 0;
+        }
+    }
+    
+    // The sections follow the section table back to back:
+    offset = sizeof(TreeFileHeader) + sizeof(TreeFileSection) * (size_t) noSections;
+    for (n = 0; n < noSections; n++)
+    {
+        sections[n].offset = offset;
+        offset += sections[n].size;
+    }
+    
+    header.magic = TREE_FILE_MAGIC;
+    header.version = TREE_FILE_VERSION;
+    header.fileSize = offset;
+    memcpy(header.boundingBox, tree->boundingBox, sizeof(int) * TREE_BOUNDING_BOX_ARRAY_SIZE);
+    header.splitListTop = tree->splitListTop;
+    header.noSplitListEntries = tree->noSplitListEntries;
+    header.noTreeListEntries = tree->noTreeListEntries;
+    header.noTreeMatrixEntries = tree->noTreeMatrixEntries;
+    header.noLeafPrimitives = tree->noLeafPrimitives;
+    header.noSections = noSections;
+    
+    // Write to a temporary file first so that a partial tree is never picked up:
+    temporaryFilename = (char *) malloc(strlen(filename) + 5);
+    if (success && temporaryFilename)
+    {
+        sprintf(temporaryFilename, "%s.tmp", filename);
+        fp = fopen(temporaryFilename, "wb");
+        success = fp != NULL;
+        success = success && fwrite(&header, sizeof(TreeFileHeader), 1, fp) == 1;
+        success = success && fwrite(sections, sizeof(TreeFileSection), (size_t) noSections, fp) == (size_t) noSections;
+        for (n = 0; n < noSections && success; n++)
+            success = fwrite(buffers[n], 1, sections[n].size, fp) == sections[n].size;
+        if (fp && fclose(fp) != 0)
+            success = 0;
+        
+        if (success && rename(temporaryFilename, filename) == 0)
+            printf("Compact tree written to \"%s\" (%lu bytes).\n\n", filename, (unsigned long) header.fileSize);
+        else
+        {
+            success = 0;
+            remove(temporaryFilename);
+        }
+    }
+    else
+        success = 0;
+    
+    if (!success)
+        printf("ERROR: Unable to write compact tree \"%s\".\n\n", filename);
+    
+    free(temporaryFilename);
+    for (n = 0; n < noSections; n++)
+        free(buffers[n]);
+    return success;
+}
+
+// Grows one object stream to the new capacity. Returns the new stream, or 0 on failure.
+void *growObjectStream(void *stream, size_t elementSize, int newCapacity)
+{
+    void *newStream;
+    
+    // A mapped cache can't be resized in place, so copy it out to the heap instead:
+    if (ObjectDBMapped)
+    {
+        newStream = malloc(elementSize * (size_t) newCapacity);
+        if (newStream)
+            memcpy(newStream, stream, elementSize * (size_t) noTriangles);
+        return newStream;
+    }
+    
+    return realloc(stream, elementSize * (size_t) newCapacity);
+}
+
+// Makes sure the object database can hold at least the required number of triangles.
+// Returns 0 if the memory couldn't be allocated.
+int growObjectDB(int required)
+{
+    int newCapacity;
+    void *stream;
     
-    treeSubWindow = glutCreateSubWindow(mainWindow, BORDER_SIZE, BORDER_SIZE, SCREEN_WIDTH / 3 - BORDER_SIZE / 2, SCREEN_HEIGHT - 2 * BORDER_SIZE);
+    if (required <= ObjectDBCapacity)
+        return 1;
     
-    // Attach renderers to the tree sub window
-    glutDisplayFunc(treeSubWindowRenderer);
-    // Then initialise UI elements
-    initTreeUI();
+    // Grow geometrically so that appending batches stays cheap:
+    newCapacity = (ObjectDBCapacity > 0) ? ObjectDBCapacity : OBJECT_DB_INITIAL_CAPACITY;
+    while (newCapacity < required)
+        newCapacity = (newCapacity > INT_MAX / 2) ? required : newCapacity * 2;
     
-    sceneSubWindow  = glutCreateSubWindow(mainWindow, SCREEN_WIDTH / 3 + BORDER_SIZE / 2, BORDER_SIZE, 2 * (SCREEN_WIDTH / 3) - BORDER_SIZE, SCREEN_HEIGHT - 2 * BORDER_SIZE);
+    // Grow each of the streams in turn:
+    if ((stream = growObjectStream(ObjectPositions, sizeof(float) * POSITION_SIZE, newCapacity)))
+        ObjectPositions = (float (*)[POSITION_SIZE]) stream;
+    if (stream && (stream = growObjectStream(ObjectNormals, sizeof(float) * NORMAL_SIZE, newCapacity)))
+        ObjectNormals = (float (*)[NORMAL_SIZE]) stream;
+    if (stream && (stream = growObjectStream(ObjectIntersections, sizeof(float) * INTERSECTION_SIZE, newCapacity)))
+        ObjectIntersections = (float (*)[INTERSECTION_SIZE]) stream;
+    if (stream && (stream = growObjectStream(ObjectUVs, sizeof(float) * UV_SIZE, newCapacity)))
+        ObjectUVs = (float (*)[UV_SIZE]) stream;
+    if (stream && (stream = growObjectStream(ObjectMaterials, sizeof(int), newCapacity)))
+        ObjectMaterials = (int *) stream;
     
-    // Attach renderers to the scene sub window
-    glutDisplayFunc(sceneSubWindowRenderer);
-    // Then initialise UI elements
-    initUI();
-    // glLoadIdentity();
-    // glOrtho(0.0, SCREEN_WIDTH - 1.0, 0.0, SCREEN_HEIGHT - 1.0, -1.0,  1.0);
+    if (!stream)
+    {
+        printf("Unable to allocate memory for %i triangles.\n\n", required);
+        return 0;
+    }
+    
+    ObjectDBMapped = 0;
+    ObjectDBCapacity = newCapacity;
+    return 1;
 }
 
-// Common UI elements are initialised within this function
-void initUI()
+// Returns the number of worker threads to use.
+int getThreadCount(void)
 {
-    GLfloat ambientLight[4] = {0.3, 0.3, 0.3, 1.0};
-    GLfloat diffuseLight[4] = {0.7, 0.7, 0.7, 1.0};
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
     
-    // Enable lighting
-    glEnable(GL_LIGHTING);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
-    glEnable(GL_LIGHT0);
+    if (cores < 1)
+        return 1;
+    return (cores > MAX_THREADS) ? MAX_THREADS : (int) cores;
+}
+
+// Runs a worker on as many threads as are useful for noTasks tasks. The workers share the
+// tasks out between themselves. Returns 0 if any of them failed.
+int runWorkerThreads(void *(*worker)(void *), void *arg, int noTasks)
+{
+    pthread_t threads[MAX_THREADS];
+    void *result;
+    int n, noThreads, success = 1;
     
-    glEnable(GL_COLOR_MATERIAL);
+    // No point starting more threads than there are tasks:
+    noThreads = getThreadCount();
+    if (noThreads > noTasks)
+        noThreads = noTasks;
     
-    glClearColor(0.0, 0.0, 0.0, 0.0);
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    // glEnable(GL_BLEND);
-    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (noThreads <= 1)
+        return (noTasks > 0 && !worker(arg)) ? 0 : 1;
     
-    glDepthFunc(GL_LEQUAL);
+    for (n = 0; n < noThreads; n++)
+    {
+        if (pthread_create(&threads[n], NULL, worker, arg) != 0)
+            break;
+    }
     
-    glutIgnoreKeyRepeat(1);
-    glutKeyboardFunc(keyboardFunc);
-    glutSpecialFunc(specialFunc);
-    glutSpecialUpFunc(specialReleaseFunc);
-    glutMouseFunc(mouseFunc);
-    glutMotionFunc(mouseMoveFunc);
+    // Help out if not every thread could be started:
+    if (n < noThreads && !worker(arg))
+        success = 0;
+    
+    noThreads = n;
+    for (n = 0; n < noThreads; n++)
+    {
+        pthread_join(threads[n], &result);
+        if (!result)
+            success = 0;
+    }
+    
+    return success;
 }
 
-void initTreeUI()
+// Converts a block of 16.16 fixed point values to floating point. The result is identical
+// to (float) value / 65536.0 as scaling by a power of two is exact.
+void convertFixedPointBlock(const int *source, float *destination, int count)
 {
-    glClearColor(0.0, 0.0, 0.0, 0.0);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
-    // glEnable(GL_BLEND);
-    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    int n = 0;
+#ifdef __SSE2__
+    __m128 scale = _mm_set1_ps(1.0f / 65536.0f);
     
-    glutIgnoreKeyRepeat(1);
-    glutKeyboardFunc(keyboardFunc);
-    glutSpecialFunc(specialFunc);
-    glutSpecialUpFunc(specialReleaseFunc);
-    // Mouse functions are different
-    glutMouseFunc(mouseTreeFunc);
-    glutMotionFunc(mouseMoveTreeFunc);
+    for (; n + 4 <= count; n += 4)
+        _mm_storeu_ps(destination + n, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (source + n))), scale));
+#endif
+    for (; n < count; n++)
+        destination[n] = (float) source[n] / 65536.0;
 }
 
-// Keyboard key capture
-void keyboardFunc(unsigned char key, int xmouse, int ymouse)
+// Decodes count triangles of a batch, starting at start, into the object database.
+void decodeSceneryChunk(SceneryBatch *batch, int start, int count, float *values)
 {
-    if (key == ESCAPE_KEY)
+    int n, idx;
+    float *value, *position, *intersection, *uv;
+    
+    // Convert the whole chunk in one go:
+    convertFixedPointBlock(batch->records + (size_t) start * SCENERY_RECORD_SIZE, values, count * SCENERY_RECORD_SIZE);
+    
+    for (n = 0; n < count; n++)
     {
-        glutDestroyWindow(mainWindow);
-        exit(0);
+        value = values + (size_t) n * SCENERY_RECORD_SIZE;
+        idx = batch->firstTriangle + start + n;
+        
+        // Vertex positions:
+        position = ObjectPositions[idx];
+        position[PositionAx] = value[SceneryRecordA + 0];
+        position[PositionAy] = value[SceneryRecordA + 1];
+        position[PositionAz] = value[SceneryRecordA + 2];
+        position[PositionBx] = value[SceneryRecordB + 0];
+        position[PositionBy] = value[SceneryRecordB + 1];
+        position[PositionBz] = value[SceneryRecordB + 2];
+        position[PositionCx] = value[SceneryRecordC + 0];
+        position[PositionCy] = value[SceneryRecordC + 1];
+        position[PositionCz] = value[SceneryRecordC + 2];
+        
+        // Normal:
+        ObjectNormals[idx][NormalX] = value[SceneryRecordNormal + 0];
+        ObjectNormals[idx][NormalY] = value[SceneryRecordNormal + 1];
+        ObjectNormals[idx][NormalZ] = value[SceneryRecordNormal + 2];
+        
+        // Intersection coefficients:
+        intersection = ObjectIntersections[idx];
+        intersection[IntersectionDominantAxisIdx] = value[SceneryRecordDominantAxisIdx];
+        intersection[IntersectionNUDom] = value[SceneryRecordNUDom];
+        intersection[IntersectionNVDom] = value[SceneryRecordNVDom];
+        intersection[IntersectionNDDom] = value[SceneryRecordNDDom];
+        intersection[IntersectionBUDom] = value[SceneryRecordBUDom];
+        intersection[IntersectionBVDom] = value[SceneryRecordBVDom];
+        intersection[IntersectionCUDom] = value[SceneryRecordCUDom];
+        intersection[IntersectionCVDom] = value[SceneryRecordCVDom];
+        
+        // UV coordinates:
+        uv = ObjectUVs[idx];
+        uv[UVAu] = value[SceneryRecordA + 3];
+        uv[UVAv] = value[SceneryRecordA + 4];
+        uv[UVBu] = value[SceneryRecordB + 3];
+        uv[UVBv] = value[SceneryRecordB + 4];
+        uv[UVCu] = value[SceneryRecordC + 3];
+        uv[UVCv] = value[SceneryRecordC + 4];
+        
+        // Finally, the material for this batch:
+        ObjectMaterials[idx] = batch->materialIdx;
     }
 }
 
-// Keyboard special key capture
-void specialFunc(int key, int xmouse, int ymouse)
+// Worker thread for decoding scenery. Chunks are handed out until there are none left.
+void *_childDecodeScenery(void *arg)
 {
-    switch(key)
+    SceneryDecoder *decoder = (SceneryDecoder *) arg;
+    float *values;
+    int chunk, start, count;
+    
+    values = (float *) malloc(sizeof(float) * SCENERY_RECORD_SIZE * SCENERY_DECODE_CHUNK);
+    if (!values)
+        return (void *) 0;
+    
+    while ((chunk = __sync_fetch_and_add(&decoder->nextChunk, 1)) < decoder->noChunks)
     {
-        case GLUT_KEY_UP:
-            deltaMoveFB = 0.5;
-            break;
-        case GLUT_KEY_DOWN:
-            deltaMoveFB = -0.5;
-            break;
-        case GLUT_KEY_LEFT:
-            deltaMoveLR = -5.0;
-            break;
-        case GLUT_KEY_RIGHT:
-            deltaMoveLR = 5.0;
-            break;
-        case GLUT_KEY_PAGE_UP:
-            deltaMoveUD = 1.0;
-            break;
-        case GLUT_KEY_PAGE_DOWN:
-            deltaMoveUD = -1.0;
-            break;
+        start = decoder->chunkStart[chunk];
+        count = decoder->batches[decoder->chunkBatch[chunk]].noTriangles - start;
+        if (count > SCENERY_DECODE_CHUNK)
+            count = SCENERY_DECODE_CHUNK;
+        
+        decodeSceneryChunk(&decoder->batches[decoder->chunkBatch[chunk]], start, count, values);
     }
+    
+    free(values);
+    return (void *) 1;
 }
 
-// Keyboard special release keys capture
-void specialReleaseFunc(int key, int xmouse, int ymouse)
+// Decodes a round of batches in parallel and frees their records. Returns 0 on failure.
+int decodeSceneryBatches(SceneryBatch *batches, int noBatches)
 {
-    switch(key)
+    SceneryDecoder decoder;
+    int n, start, success = 1;
+    
+    // Split each batch into chunks so that a single large batch is shared out too:
+    decoder.noChunks = 0;
+    for (n = 0; n < noBatches; n++)
+        decoder.noChunks += (batches[n].noTriangles + SCENERY_DECODE_CHUNK - 1) / SCENERY_DECODE_CHUNK;
+    
+    decoder.batches = batches;
+    decoder.nextChunk = 0;
+    decoder.chunkBatch = (int *) malloc(sizeof(int) * (decoder.noChunks + 1));
+    decoder.chunkStart = (int *) malloc(sizeof(int) * (decoder.noChunks + 1));
+    
+    if (!decoder.chunkBatch || !decoder.chunkStart)
     {
-        case GLUT_KEY_UP:
-        case GLUT_KEY_DOWN:
-            deltaMoveFB = 0;
-            break;
-        case GLUT_KEY_LEFT:
-        case GLUT_KEY_RIGHT:
-            deltaMoveLR = 0;
-            break;
-        case GLUT_KEY_PAGE_UP:
-        case GLUT_KEY_PAGE_DOWN:
-            deltaMoveUD = 0;
-            break;
+        printf("Unable to allocate memory for decoding scenery.\n\n");
+        success = 0;
+    }
+    else
+    {
+        decoder.noChunks = 0;
+        for (n = 0; n < noBatches; n++)
+        {
+            for (start = 0; start < batches[n].noTriangles; start += SCENERY_DECODE_CHUNK)
+            {
+                decoder.chunkBatch[decoder.noChunks] = n;
+                decoder.chunkStart[decoder.noChunks] = start;
+                decoder.noChunks++;
+            }
+        }
+        
+        success = runWorkerThreads(_childDecodeScenery, &decoder, decoder.noChunks);
+        
+        if (!success)
+            printf("Unable to allocate memory for decoding scenery.\n\n");
     }
+    
+    free(decoder.chunkBatch);
+    free(decoder.chunkStart);
+    for (n = 0; n < noBatches; n++)
+        free(batches[n].records);
+    
+    return success;
 }
 
-// Mouse button capture.
-void mouseFunc(int button, int state, int xmouse, int ymouse)
+// Function to load the scenery file to memory and populate the object and material database
+int LoadScenery(char *filename)
 {
-    if (button == GLUT_RIGHT_BUTTON)
+    FILE *fp;
+    int n, m, zeroCheck, matIdx, textIdx, localNoTriangles, localNoMaterials, localNoTextures;
+    int noBatches = 0, roundTriangles = 0, failed = 0, success, *records;
+    char *textureFilename;
+    SceneryBatch *batches;
+    TextureLoader textureLoader;
+    struct stat sourceStats;
+    uint64_t sourceHash, textureFilesStamp = 0;
+    int useCache = 0;
+    
+    // File initialisation:
+    printf("Reading world file \"%s\"\n", filename);
+    
+    fp = fopen(filename, "rb");
+    if (!fp)
+        return 0;
+    
+    // Populate local counters
+    fread(&localNoMaterials, sizeof(int), 1, fp);
+    fread(&localNoTextures, sizeof(int), 1, fp);
+    
+    // Verify that we're not going to overflow:
+    if (localNoTextures + noTextures > MAX_TEXTURES)
     {
-        // Check if the button was released:
-        if (state == GLUT_UP)
+        printf("Too many textures requested (%i). Current texture limit set to %i.\n\n", localNoTextures + noTextures, MAX_TEXTURES);
+        fclose(fp);
+        return 0;
+    }
+    if (localNoMaterials + noMaterials > MAX_MATERIALS)
+    {
+        printf("Too many materials requested (%i). Current material limit set to %i.\n\n", localNoMaterials + noMaterials, MAX_MATERIALS);
+        fclose(fp);
+        return 0;
+    }
+    
+    // Now read the texture filenames. The textures themselves are read later on, in the background:
+    textureLoader.filenames = (char **) calloc((size_t) localNoTextures + 1, sizeof(char *));
+    textureLoader.firstTexture = noTextures;
+    textureLoader.noTextures = localNoTextures;
+    if (!textureLoader.filenames)
+    {
+        printf("Unable to allocate memory for %i texture filenames.\n\n", localNoTextures);
+        fclose(fp);
+        return 0;
+    }
+    for (n = 0; n < localNoTextures; n++)
+    {
+        // Read the filename:
+        fread(&m, sizeof(int), 1, fp);
+        textureFilename = (char *) malloc(sizeof(char) * (m + 1));
+        // Blank memory:
+        memset(textureFilename, 0, sizeof(char) * (m + 1));
+        // Then read the m characters:
+        fread(textureFilename, sizeof(char), m, fp);
+        
+        // Cater for the special case:
+        if (strcmp(textureFilename, "terrain.tga") != 0 && m != 25)
         {
-            angleX += deltaAngleX;
-            angleY += deltaAngleY;
-            
-            xOrigin = -1;
-            yOrigin = -1;
+            memcpy(textureFilename, textureFilename + 12, 36);
+            memset(textureFilename + 36, 0, sizeof(char) * 12);
         }
         else
         {
-            xOrigin = xmouse;
-            yOrigin = ymouse;
+            if (m == 25)
+                textureFilename[8] = '/';
+        }
+        
+        // Queue the texture to be read:
+        textureLoader.filenames[n] = textureFilename;
+    }
+    
+    // A cache can only stand in for the scenery if nothing else has been loaded yet. It holds
+    // the textures' pixels too, so it's keyed on the texture files as well as the scene:
+    if (SceneCacheFilename && noTriangles == 0 && noMaterials == 0 && noTextures == 0)
+    {
+        if (stat(filename, &sourceStats) == 0 && hashFileWords(filename, &sourceHash))
+        {
+            useCache = 1;
+            textureFilesStamp = stampTextureFiles(textureLoader.filenames, localNoTextures);
+            if (LoadSceneCache(SceneCacheFilename, &sourceStats, sourceHash, textureFilesStamp))
+            {
+                printf("Scenery restored from cache \"%s\".\n\n", SceneCacheFilename);
+                for (n = 0; n < localNoTextures; n++)
+                    free(textureLoader.filenames[n]);
+                free(textureLoader.filenames);
+                fclose(fp);
+                return 1;
+            }
+        }
+    }
+    
+    // Increment the global number of textures
+    noTextures += localNoTextures;
+    
+    // We should now encounter a zero in the file. Verify this is the case:
+    fread(&zeroCheck, sizeof(int), 1, fp);
+    if (zeroCheck != 0)
+    {
+        printf("\nERROR: Error encountered entering filenames. Failed zero check.\n");
+        for (n = 0; n < localNoTextures; n++)
+            free(textureLoader.filenames[n]);
+        free(textureLoader.filenames);
+        fclose(fp);
+        return 0;
+    }
+    
+    // Now proceed to load materials
+    for (n = 0; n < localNoMaterials; n++)
+    {
+        // Read the material index and then read the texture index:
+        fread(&matIdx, sizeof(int), 1, fp);
+        fread(&textIdx, sizeof(int), 1, fp);
+        
+        // Now create a material:
+        setMaterial(matIdx, textIdx);
+    }
+    
+    // Increment the global number of materials
+    noMaterials = localNoMaterials;
+    
+    // We should now encounter a zero in the file. Verify this is the case:
+    fread(&zeroCheck, sizeof(int), 1, fp);
+    if (zeroCheck != 0)
+    {
+        printf("\nERROR: Error encountered pairing materials with textures. Failed zero check.\n");
+        for (n = 0; n < localNoTextures; n++)
+            free(textureLoader.filenames[n]);
+        free(textureLoader.filenames);
+        fclose(fp);
+        return 0;
+    }
+    
+    // Read the textures while the triangles are being parsed:
+    startTextureLoader(&textureLoader);
+    
+    // Start the triangle loading process. Each batch is pulled in with a single read and the
+    // batches are decoded a round at a time across all cores.
+    batches = (SceneryBatch *) malloc(sizeof(SceneryBatch) * SCENERY_DECODE_ROUND_BATCHES);
+    if (!batches)
+    {
+        printf("Unable to allocate memory for scenery batches.\n\n");
+        finishTextureLoader(&textureLoader);
+        fclose(fp);
+        return 0;
+    }
+    
+    while (fread(&localNoTriangles, sizeof(int), 1, fp) == 1)
+    {
+        // Make room for this batch of triangles:
+        if (localNoTriangles < 0 || localNoTriangles > INT_MAX - noTriangles || localNoTriangles > (INT_MAX - 2) / SCENERY_RECORD_SIZE)
+        {
+            printf("\nERROR: Invalid number of triangles in batch (%i).\n", localNoTriangles);
+            failed = 1;
+            break;
+        }
+        // The render thread may be reading the triangles published so far, so the streams
+        // can only move with the lock held:
+        pthread_mutex_lock(&Loading.lock);
+        success = growObjectDB(noTriangles + localNoTriangles);
+        pthread_mutex_unlock(&Loading.lock);
+        if (!success)
+        {
+            failed = 1;
+            break;
+        }
+        
+        // Read the triangle records along with the trailing material index and zero check:
+        records = (int *) malloc(sizeof(int) * ((size_t) localNoTriangles * SCENERY_RECORD_SIZE + 2));
+        if (!records)
+        {
+            printf("Unable to allocate memory for %i triangle records.\n\n", localNoTriangles);
+            failed = 1;
+            break;
+        }
+        if (fread(records, sizeof(int), (size_t) localNoTriangles * SCENERY_RECORD_SIZE + 2, fp) != (size_t) localNoTriangles * SCENERY_RECORD_SIZE + 2)
+        {
+            printf("\nERROR: Scenery file ended part way through a batch of triangles.\n");
+            free(records);
+            failed = 1;
+            break;
+        }
+        
+        // The record block is followed by a zero check:
+        if (records[(size_t) localNoTriangles * SCENERY_RECORD_SIZE + 1] != 0)
+        {
+            printf("\nERROR: Error encountered pairing triangle points with UV values. Failed zero check.\n");
+            free(records);
+            failed = 1;
+            break;
         }
-    }
-    else if (button == GLUT_LEFT_BUTTON)
-    {
-        if (state == GLUT_UP)
+        
+        // Queue up this batch:
+        batches[noBatches].records = records;
+        batches[noBatches].firstTriangle = noTriangles;
+        batches[noBatches].noTriangles = localNoTriangles;
+        batches[noBatches].materialIdx = records[(size_t) localNoTriangles * SCENERY_RECORD_SIZE];
+        noBatches++;
+        noTriangles += localNoTriangles;
+        roundTriangles += localNoTriangles;
+        
+        // Decode once enough work has built up:
+        if (noBatches == SCENERY_DECODE_ROUND_BATCHES || roundTriangles >= SCENERY_DECODE_ROUND_TRIANGLES)
         {
-            printf("UP %i, %i\n", xmouse, ymouse);
+            success = decodeSceneryBatches(batches, noBatches);
+            noBatches = 0;
+            roundTriangles = 0;
+            if (!success)
+            {
+                failed = 1;
+                break;
+            }
             
+            // Every batch queued so far is decoded, so they can be drawn:
+            publishTrianglesReady();
         }
+    }
+    
+    // Decode whatever is left over:
+    if (!failed && noBatches > 0)
+    {
+        if (!decodeSceneryBatches(batches, noBatches))
+            failed = 1;
         else
-        {
-            printf("DOWN (%i) %i, %i\n", state, xmouse, ymouse);
-        }
+            publishTrianglesReady();
+        noBatches = 0;
+    }
+    
+    // Release any batches that never got decoded:
+    for (n = 0; n < noBatches; n++)
+        free(batches[n].records);
+    free(batches);
+    
+    // The textures have to be in before the scenery counts as loaded:
+    finishTextureLoader(&textureLoader);
+    
+    if (failed)
+    {
+        fclose(fp);
+        return 0;
     }
+    
+    // File read.
+    printf("Scenery file read successfully.\n\n");
+    
+    // Close the file pointer before terminating:
+    fclose(fp);
+    
+    // Save the decoded scenery for next time:
+    if (useCache)
+        WriteSceneCache(SceneCacheFilename, &sourceStats, sourceHash, textureFilesStamp);
+    
+    return 1;
 }
 
-// Mouse movement capture.
-void mouseMoveFunc(int xmouse, int ymouse)
+// Spreads every bit of value across all 64 bits of the result. This is MurmurHash3's finaliser.
+uint64_t mixHashWord(uint64_t value)
 {
-    // If the xOrigin is positive then the right mouse button is held down:
-    if (xOrigin >= 0)
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// Computes a 64-bit hash of a file's contents a word at a time. Each word is folded in as FNV
+// would fold in a byte, and the state is then mixed by mixHashWord, so the same change made to
+// two words can't cancel out. It's only used to tell a stale scene cache from a good one.
+// Returns 0 on failure.
+int hashFileWords(char *filename, uint64_t *hash)
+{
+    FILE *fp;
+    unsigned char *buffer;
+    uint64_t word;
+    size_t length, n;
+    
+    fp = fopen(filename, "rb");
+    if (!fp)
+        return 0;
+    
+    buffer = (unsigned char *) malloc(SCENE_CACHE_HASH_BLOCK);
+    if (!buffer)
     {
-        // Update the deltaAngle:
-        deltaAngleX = (xmouse - xOrigin) * 0.001;
-        deltaAngleY = (ymouse - yOrigin) * 0.001;
-        
-        lx = sin(angleY + deltaAngleY) * cos(angleX + deltaAngleX);
-        ly = cos(angleY + deltaAngleY);
-        lz = sin(angleY + deltaAngleY) * sin(angleX + deltaAngleX);
+        fclose(fp);
+        return 0;
+    }
+    
+    *hash = 0xCBF29CE484222325ULL;
+    while ((length = fread(buffer, 1, SCENE_CACHE_HASH_BLOCK, fp)) > 0)
+    {
+        // Pad the tail of a partial word with zeros:
+        if (length % sizeof(uint64_t))
+            memset(buffer + length, 0, sizeof(uint64_t) - length % sizeof(uint64_t));
         
-        glutSetWindow(mainWindow);
-        glutPostRedisplay();
+        for (n = 0; n < length; n += sizeof(uint64_t))
+        {
+            memcpy(&word, buffer + n, sizeof(uint64_t));
+            *hash = mixHashWord((*hash ^ word) * 0x100000001B3ULL);
+        }
+        // Mix in the length so trailing zeros still change the hash:
+        *hash = mixHashWord((*hash ^ length) * 0x100000001B3ULL);
     }
+    
+    free(buffer);
+    fclose(fp);
+    return 1;
 }
 
-void mouseTreeFunc(int button, int state, int xmouse, int ymouse)
+// Folds the size and modification time of every texture file into one value, so that a
+// scene cache can tell when any of the textures it holds has changed. A missing file counts too.
+uint64_t stampTextureFiles(char **filenames, int noFilenames)
 {
-    int depth, estx, count = 0, n;
-    if (button == GLUT_LEFT_BUTTON)
+    struct stat fileStats;
+    uint64_t stamp = 0xCBF29CE484222325ULL;
+    int n;
+    
+    for (n = 0; n < noFilenames; n++)
     {
-        if (state == GLUT_UP)
+        if (stat(filenames[n], &fileStats) == 0)
         {
-            printf("UP %i, %i\n", xmouse, ymouse);
-            depth = (int)((ymouse - 5.0) / (NODE_DRAW_SQUARE_SIZE * 2.0));
-            // Early exit cases
-            if (depth > MAX_TREE_DEPTH + 1)
-                return;
-            if (TreeDepthCounter[depth] == 0)
-                return;
-            // If here, we could have a genuine hit.
-            // Reverse engineer
-            estx = (int) ((((float) xmouse * (float) TreeDepthCounter[depth]) / ((float) TreeDepthMaxCount * NODE_DRAW_SQUARE_SIZE) - 1) / 2.0);
-            for (n = 0; n < noTreeMatrixEntries; n++)
-            {
-                // Quick reject
-                if (TreeDepthAssignment[n] != depth)
-                    continue;
-                if (count == estx)
-                {
-                    // Only change if the item isn't a leaf node.
-                    // if (TreeMatrix[n][TREE_MATRIX_LEAF_NODE] < 0)
-                        SelectedNodeIdx = n;
-                    return;
-                }
-                count++;
-            }
+            stamp = mixHashWord((stamp ^ (uint64_t) fileStats.st_size) * 0x100000001B3ULL);
+            stamp = mixHashWord((stamp ^ (uint64_t) fileStats.st_mtime) * 0x100000001B3ULL);
         }
         else
-        {
-            printf("DOWN (%i) %i, %i\n", state, xmouse, ymouse);
-        }
+            stamp = mixHashWord((stamp ^ ~0ULL) * 0x100000001B3ULL);
     }
-}
-
-void mouseMoveTreeFunc(int xmouse, int ymouse)
-{
     
+    return stamp;
 }
 
-int main (int argc, char *argv[])
+// Restores the scenery from a cache file, if the cache matches the source. The triangle
+// and texture data are used straight from the mapping. Returns 0 if the cache can't be used.
+int LoadSceneCache(char *cacheFilename, struct stat *sourceStats, uint64_t sourceHash, uint64_t textureFilesStamp)
 {
-    char *currObj, *parVal = "", *treeFilename = 0, *sceneFilename = 0;
-    int isParam, i, n, a;
+    int fd, n;
+    struct stat cacheStats;
+    SceneCacheHeader *header;
+    unsigned char *mapping;
+    size_t textureSize;
     
-    printf("\nTreeAnalyser ");
-    printf("Version: %i.%i.%i (%s)\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
-    printf("Author: Andrew Hills (a.hills@sheffield.ac.uk)\n\n");
+    fd = open(cacheFilename, O_RDONLY);
+    if (fd < 0)
+        return 0;
     
-    for (i = 1; i < argc; i++)
+    if (fstat(fd, &cacheStats) < 0 || cacheStats.st_size < (off_t) sizeof(SceneCacheHeader))
     {
-        currObj = argv[i];
-        isParam = 0;
-        a = strlen(argv[i]);
-        for (n = 0; n < a; n++)
-        {
-            if (argv[i][n] == '-')
-                isParam = 1;
-            else
-                break;
-        }
-        if (isParam)
-        {
-            memmove(&currObj[0], &currObj[n], strlen(currObj) - n + 1);
-            parVal = currObj;
-        }
-        else
-        {
-            if (strcmp(parVal, ""))
-            {
-                if (!strcmp(parVal, "tree"))
-                {
-                    // Read in the tree filename
-                    treeFilename = currObj;
-                }
-                else if (!strcmp(parVal, "scene"))
-                {
-                    // Read in the scene filename
-                    sceneFilename = currObj;
-                }
-                else
-                {
-                    printf("Unrecognised input \"%s\"\n\n", parVal);
-                }
-            }
-        }
+        close(fd);
+        return 0;
     }
     
-    // Check the tree variable for assignment.
-    if (!treeFilename)
+    // Map privately so nothing written by the analyser can make it back to the cache:
+    mapping = (unsigned char *) mmap(NULL, (size_t) cacheStats.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return 0;
+    
+    // Check the cache belongs to this version of the source file:
+    header = (SceneCacheHeader *) mapping;
+    if (header->magic != SCENE_CACHE_MAGIC || header->version != SCENE_CACHE_VERSION ||
+        header->fileSize != (uint64_t) cacheStats.st_size ||
+        header->sourceSize != (uint64_t) sourceStats->st_size ||
+        header->sourceModified != (uint64_t) sourceStats->st_mtime || header->sourceHash != sourceHash ||
+        header->textureFilesStamp != textureFilesStamp ||
+        header->noTriangles < 0 || header->noMaterials < 0 || header->noMaterials > MAX_MATERIALS ||
+        header->noTextures < 0 || header->noTextures > MAX_TEXTURES ||
+        header->positionOffset + sizeof(float) * POSITION_SIZE * (uint64_t) header->noTriangles > header->fileSize ||
+        header->normalOffset + sizeof(float) * NORMAL_SIZE * (uint64_t) header->noTriangles > header->fileSize ||
+        header->intersectionOffset + sizeof(float) * INTERSECTION_SIZE * (uint64_t) header->noTriangles > header->fileSize ||
+        header->uvOffset + sizeof(float) * UV_SIZE * (uint64_t) header->noTriangles > header->fileSize ||
+        header->objectMaterialOffset + sizeof(int) * (uint64_t) header->noTriangles > header->fileSize ||
+        header->materialOffset + sizeof(MaterialDB) > header->fileSize ||
+        header->textureOffset + sizeof(TextureDB) > header->fileSize)
     {
-        // It wasn't assigned to anything.
-        printf("ERROR: Tree filename needs to be specified.\n\n");
-        exit(-1);
+        printf("Scene cache \"%s\" is out of date.\n", cacheFilename);
+        munmap(mapping, (size_t) cacheStats.st_size);
+        return 0;
     }
     
-    // If here, we can load the tree:
-    LoadTree(treeFilename);
+    // The material and texture tables are small enough to copy:
+    memcpy(MaterialDB, mapping + header->materialOffset, sizeof(MaterialDB));
+    memcpy(TextureDB, mapping + header->textureOffset, sizeof(TextureDB));
     
-    // Has the scenery filename been defined?
-    if (sceneFilename)
+    // Texture data is used in place:
+    for (n = 0; n < header->noTextures; n++)
     {
-        // Yes, then load the scenery file.
-        if(!LoadScenery(sceneFilename))
-            printf("WARNING: Unable to load the scenery file \"%s\". Verify that it exists and is valid.\n\n", sceneFilename);
-        else
-            SceneryLoaded = 1;
+        Textures[n].data = 0;
+        if (!header->textureDataOffsets[n])
+            continue;
+        
+        textureSize = (size_t) TextureDB[n][TextureWidth] * TextureDB[n][TextureHeight] * TEXTURE_CHANNELS;
+        if (header->textureDataOffsets[n] + textureSize > header->fileSize)
+            continue;
+        Textures[n].data = mapping + header->textureDataOffsets[n];
     }
     
-    // Now begin by computing the tree stats.
-    printf("Initialising depth counter... ");
-    initialiseTreeDepthCounter();
-    printf("Done.\n");
-    
-    // Then populate the node counter
-    printf("Populating depth counter... ");
-    populateTreeDepthCounter();
-    printf("Done.\n\n");
+    // As are the object streams:
+    ObjectPositions = (float (*)[POSITION_SIZE]) (mapping + header->positionOffset);
+    ObjectNormals = (float (*)[NORMAL_SIZE]) (mapping + header->normalOffset);
+    ObjectIntersections = (float (*)[INTERSECTION_SIZE]) (mapping + header->intersectionOffset);
+    ObjectUVs = (float (*)[UV_SIZE]) (mapping + header->uvOffset);
+    ObjectMaterials = (int *) (mapping + header->objectMaterialOffset);
+    ObjectDBCapacity = header->noTriangles;
+    ObjectDBMapped = 1;
     
-    // Then get node stats. Start by initialising counters:
-    printf("Initialising node counter... ");
-    initialiseTreeNodeCounter();
-    printf("Done.\n");
-    // And then populate the array:
-    printf("Populating node counter... ");
-    populateTreeNodeCounter();
-    printf("Done.\n\n");
+    noTriangles = header->noTriangles;
+    noMaterials = header->noMaterials;
+    noTextures = header->noTextures;
     
-    initialiseGLUT(argc, argv);
+    return 1;
+}
+
+// Writes a page aligned section to the cache and records where it was put. Returns 0 on failure.
+int writeCacheSection(FILE *fp, const void *data, size_t size, uint64_t *offset)
+{
+    long position = ftell(fp);
     
-    // glEnable(GL_DEPTH_TEST);
+    if (position < 0)
+        return 0;
     
-    glutMainLoop();
+    // Pad out to the next page:
+    while (position % SCENE_CACHE_ALIGNMENT)
+    {
+        if (fputc(0, fp) == EOF)
+            return 0;
+        position++;
+    }
     
-    return 1;
+    *offset = (uint64_t) position;
+    return fwrite(data, 1, size, fp) == size;
 }
 
-// Function to load a tree file to memory
-void LoadTree(char *filename)
+// Writes the currently loaded scenery out as a cache for the given source file.
+void WriteSceneCache(char *cacheFilename, struct stat *sourceStats, uint64_t sourceHash, uint64_t textureFilesStamp)
 {
     FILE *fp;
+    SceneCacheHeader header;
+    char *temporaryFilename;
+    int n, success;
+    size_t textureSize;
     
-    printf("Restoring tree to memory...\n");
-    
-    // Open the file for reading
-    fp = fopen(filename, "rb");
+    // Write to a temporary file first so that a partial cache is never picked up:
+    temporaryFilename = (char *) malloc(strlen(cacheFilename) + 5);
+    if (!temporaryFilename)
+        return;
+    sprintf(temporaryFilename, "%s.tmp", cacheFilename);
     
+    fp = fopen(temporaryFilename, "wb");
     if (!fp)
     {
-        // Invalid file
-        printf("ERROR: Unable to open \"%s\" for reading.\n\n", filename);
-        exit(-100);
+        printf("WARNING: Unable to write scene cache \"%s\".\n\n", cacheFilename);
+        free(temporaryFilename);
+        return;
     }
     
-    // If here, the file was opened successfully. Now start reading:
-    fread(SceneBoundingBox, sizeof(int), TREE_BOUNDING_BOX_ARRAY_SIZE, fp);
+    memset(&header, 0, sizeof(SceneCacheHeader));
+    header.magic = SCENE_CACHE_MAGIC;
+    header.version = SCENE_CACHE_VERSION;
+    header.sourceSize = (uint64_t) sourceStats->st_size;
+    header.sourceModified = (uint64_t) sourceStats->st_mtime;
+    header.sourceHash = sourceHash;
+    header.textureFilesStamp = textureFilesStamp;
+    header.noTriangles = noTriangles;
+    header.noMaterials = noMaterials;
+    header.noTextures = noTextures;
     
-    // Then load constants:
-    fread(&SplitListTop, sizeof(int), 1, fp);
-    fread(&noSplitListEntries, sizeof(int), 1, fp);
-    fread(&noTreeListEntries, sizeof(int), 1, fp);
-    fread(&noTreeMatrixEntries, sizeof(int), 1, fp);
-    fread(&noNodeListEntries, sizeof(int), 1, fp);
+    // Reserve space for the header. It's rewritten once the offsets are known.
+    success = fwrite(&header, sizeof(SceneCacheHeader), 1, fp) == 1;
     
-    // Now import the tree matrix:
-    fread(TreeMatrix, sizeof(int), noTreeMatrixEntries * TREE_MATRIX_SIZE, fp);
+    success = success && writeCacheSection(fp, ObjectPositions, sizeof(float) * POSITION_SIZE * (size_t) noTriangles, &header.positionOffset);
+    success = success && writeCacheSection(fp, ObjectNormals, sizeof(float) * NORMAL_SIZE * (size_t) noTriangles, &header.normalOffset);
+    success = success && writeCacheSection(fp, ObjectIntersections, sizeof(float) * INTERSECTION_SIZE * (size_t) noTriangles, &header.intersectionOffset);
+    success = success && writeCacheSection(fp, ObjectUVs, sizeof(float) * UV_SIZE * (size_t) noTriangles, &header.uvOffset);
+    success = success && writeCacheSection(fp, ObjectMaterials, sizeof(int) * (size_t) noTriangles, &header.objectMaterialOffset);
+    success = success && writeCacheSection(fp, MaterialDB, sizeof(MaterialDB), &header.materialOffset);
+    success = success && writeCacheSection(fp, TextureDB, sizeof(TextureDB), &header.textureOffset);
     
-    // Then the tree list:
-    fread(TreeList, sizeof(int), noTreeListEntries * TREE_LIST_SIZE, fp);
+    for (n = 0; n < noTextures && success; n++)
+    {
+        if (!Textures[n].data)
+            continue;
+        
+        textureSize = (size_t) TextureDB[n][TextureWidth] * TextureDB[n][TextureHeight] * TEXTURE_CHANNELS;
+        success = writeCacheSection(fp, Textures[n].data, textureSize, &header.textureDataOffsets[n]);
+    }
     
-    // Then the split list:
-    fread(SplitList, sizeof(int), (MAX_TRIANGLES * 2 + 8) * SPLIT_LIST_SIZE, fp);
+    // Now fill in the real header:
+    if (success)
+    {
+        header.fileSize = (uint64_t) ftell(fp);
+        success = fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(SceneCacheHeader), 1, fp) == 1;
+    }
     
-    // Finally the node list:
-    fread(NodeList, sizeof(int), (MAX_TRIANGLES * 20) * NODE_LIST_SIZE, fp);
+    if (fclose(fp) != 0)
+        success = 0;
     
-    // As there's nothing else to read, close the file pointer:
-    fclose(fp);
+    if (success && rename(temporaryFilename, cacheFilename) == 0)
+        printf("Scene cache written to \"%s\".\n\n", cacheFilename);
+    else
+    {
+        printf("WARNING: Unable to write scene cache \"%s\".\n\n", cacheFilename);
+        remove(temporaryFilename);
+    }
     
-    printf("Tree state restored from \"%s\".\n\n", filename);
+    free(temporaryFilename);
 }
 
-// Function to load the scenery file to memory and populate the object and material database
-int LoadScenery(char *filename)
+// Reads an uncompressed 24 or 32-bit TGA file into a texture as 8-bit RGBA. Textures without
+// an alpha channel are made opaque. Each texture is only ever read by one thread.
+void ReadTexture(int textureIdx, char *filename)
 {
+    unsigned char header[TGA_HEADER_SIZE], *pixels, *bitmap;
+    int width, height, channels;
+    size_t size, n;
     FILE *fp;
-    int x, y, z, a, b;
-    int n, m, zeroCheck, matIdx, textIdx, localNoTriangles, localNoMaterials, localNoTextures;
-    char *textureFilename;
-    int DominantAxisIdx, NUDom, NVDom, NDDom, BUDom, BVDom, CUDom, CVDom, totalTriangles = noTriangles;
     
-    // File initialisation:
-    printf("Reading world file \"%s\"\n", filename);
+    Textures[textureIdx].data = NULL;
     
+    // Open the file
     fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("Error encountered opening texture file \"%s\".\n", filename);
+        return;
+    }
     
-    // Populate local counters
-    fread(&localNoMaterials, sizeof(int), 1, fp);
-    fread(&localNoTextures, sizeof(int), 1, fp);
+    // The header gives the size and depth. The pixels follow the optional image ID:
+    if (fread(header, 1, TGA_HEADER_SIZE, fp) != TGA_HEADER_SIZE || header[2] != TGA_TYPE_TRUE_COLOUR ||
+        (header[16] != 24 && header[16] != 32) || fseek(fp, header[0], SEEK_CUR) != 0)
+    {
+        printf("WARNING: Texture file \"%s\" isn't an uncompressed 24 or 32-bit TGA.\n", filename);
+        fclose(fp);
+        return;
+    }
+    width = header[12] + 256 * header[13];
+    height = header[14] + 256 * header[15];
+    channels = header[16] / 8;
+    size = (size_t) width * height;
     
-    // Verify that we're not going to overflow:
-    if (localNoTextures + noTextures > MAX_TEXTURES)
+    // Now to read the pixel data in one go:
+    pixels = (unsigned char *) malloc(size * channels + 1);
+    bitmap = (unsigned char *) malloc(size * TEXTURE_CHANNELS + 1);
+    if (!pixels || !bitmap || fread(pixels, channels, size, fp) != size)
     {
-        printf("Too many textures requested (%i). Current texture limit set to %i.\n\n", localNoTextures + noTextures, MAX_TEXTURES);
+        printf("WARNING: Unable to read the pixels of texture file \"%s\".\n", filename);
+        free(pixels);
+        free(bitmap);
         fclose(fp);
-        return 0;
+        return;
+    }
+    fclose(fp);
+    
+    // TGA stores its pixels as BGR(A):
+    for (n = 0; n < size; n++)
+    {
+        bitmap[n * TEXTURE_CHANNELS + 0] = pixels[n * channels + 2];
+        bitmap[n * TEXTURE_CHANNELS + 1] = pixels[n * channels + 1];
+        bitmap[n * TEXTURE_CHANNELS + 2] = pixels[n * channels + 0];
+        bitmap[n * TEXTURE_CHANNELS + 3] = (channels == 4) ? pixels[n * channels + 3] : 255;
+    }
+    free(pixels);
+    Textures[textureIdx].data = bitmap;
+    
+    // Now populate the TextureDB array:
+    TextureDB[textureIdx][TextureHeight] = height;
+    TextureDB[textureIdx][TextureWidth] = width;
+    TextureDB[textureIdx][TextureAlpha] = (channels == 3) ? 0 : 1;
+    TextureDB[textureIdx][TextureMemStart] = 0;
+}
+
+// Worker thread for reading textures. Textures are handed out until there are none left.
+void *_childReadTextures(void *arg)
+{
+    TextureLoader *loader = (TextureLoader *) arg;
+    int n;
+    
+    while ((n = __sync_fetch_and_add(&loader->nextTexture, 1)) < loader->noTextures)
+        ReadTexture(loader->firstTexture + n, loader->filenames[n]);
+    
+    return (void *) 1;
+}
+
+// Starts reading the loader's textures in the background.
+void startTextureLoader(TextureLoader *loader)
+{
+    loader->nextTexture = 0;
+    loader->noThreads = 0;
+    while (loader->noThreads < TEXTURE_LOADER_THREADS && loader->noThreads < loader->noTextures)
+    {
+        if (pthread_create(&loader->threads[loader->noThreads], NULL, _childReadTextures, loader) != 0)
+            break;
+        loader->noThreads++;
+    }
+}
+
+// Waits for the loader's textures to be read, reading any left over on this thread, and then
+// frees the filenames.
+void finishTextureLoader(TextureLoader *loader)
+{
+    int n;
+    
+    _childReadTextures(loader);
+    for (n = 0; n < loader->noThreads; n++)
+        pthread_join(loader->threads[n], NULL);
+    
+    for (n = 0; n < loader->noTextures; n++)
+        free(loader->filenames[n]);
+    free(loader->filenames);
+    loader->filenames = NULL;
+    loader->noThreads = 0;
+}
+
+// Hands every texture that was read to GL with a full set of mipmaps. This needs the scene
+// sub window's context, so it's done along with the scene buffers.
+void uploadTextures(void)
+{
+    int n;
+    
+    for (n = 0; n < noTextures; n++)
+    {
+        if (!Textures[n].data || Textures[n].name)
+            continue;
+        
+        glGenTextures(1, &Textures[n].name);
+        glBindTexture(GL_TEXTURE_2D, Textures[n].name);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        if (gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA, TextureDB[n][TextureWidth], TextureDB[n][TextureHeight], GL_RGBA, GL_UNSIGNED_BYTE, Textures[n].data) != 0)
+        {
+            printf("WARNING: Unable to upload texture %i.\n", n);
+            glDeleteTextures(1, &Textures[n].name);
+            Textures[n].name = 0;
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Finds the GL texture of a material. Returns the texture's index, or -1 if it doesn't have one.
+int materialTexture(int materialIdx)
+{
+    int textureIdx;
+    
+    if (materialIdx < 0 || materialIdx >= MAX_MATERIALS)
+        return -1;
+    
+    // Materials keep their texture index as a converted fixed point value:
+    textureIdx = (int) lroundf(MaterialDB[materialIdx][MaterialTextureIndex] * 65536.0);
+    if (textureIdx < 0 || textureIdx >= noTextures || !Textures[textureIdx].name)
+        return -1;
+    
+    return textureIdx;
+}
+
+void setMaterial(int materialIdx, int textureIdx)
+{
+    int n;
+    
+    // Set the texture index:
+    MaterialDB[materialIdx][MaterialTextureIndex] = (float) textureIdx / 65536.0;
+    
+    // Then set everything to defaults:
+    for (n = 0; n < 3; n ++)
+        MaterialDB[materialIdx][MaterialColour + n] = 0.7; // Light grey
+}
+
+// Hands the triangles published since the last draw over to GL and extends the material
+// batches over them. The buffers double in size when they fill up, and everything is then
+// uploaded again. This needs the scene sub window's context, so it's done as the scene is drawn.
+void streamSceneBuffers(void)
+{
+    int n, m, first, ready, capacity;
+    float (*vertexNormals)[NORMAL_SIZE];
+    
+    // The textures are all read by the time the scenery is done:
+    if (ViewSceneryDone && !SceneTexturesUploaded)
+    {
+        SceneTexturesUploaded = 1;
+        uploadTextures();
+    }
+    
+    // The object streams can move while the scenery loads, so they're only read with the lock held:
+    pthread_mutex_lock(&Loading.lock);
+    ready = Loading.noTrianglesReady;
+    // Fewer triangles than were uploaded means the scenery failed part way, so stop drawing them:
+    if (ready < SceneTrianglesUploaded)
+    {
+        SceneTrianglesUploaded = 0;
+        noSceneDrawBatches = 0;
     }
-    if (localNoMaterials + noMaterials > MAX_MATERIALS)
+    if (ready <= SceneTrianglesUploaded)
     {
-        printf("Too many materials requested (%i). Current material limit set to %i.\n\n", localNoMaterials + noMaterials, MAX_MATERIALS);
-        fclose(fp);
-        return 0;
+        pthread_mutex_unlock(&Loading.lock);
+        return;
     }
     
-    // Now read the textures:
-    for (n = 0; n < localNoTextures; n++)
+    first = SceneTrianglesUploaded;
+    if (ready > SceneBufferCapacity)
     {
-        // Read the filename:
-        fread(&m, sizeof(int), 1, fp);
-        textureFilename = (char *) malloc(sizeof(char) * (m + 1));
-        // Blank memory:
-        memset(textureFilename, 0, sizeof(char) * (m + 1));
-        // Then read the m characters:
-        fread(textureFilename, sizeof(char), m, fp);
+        capacity = (SceneBufferCapacity > 0) ? SceneBufferCapacity : SCENE_BUFFER_INITIAL_TRIANGLES;
+        while (capacity < ready)
+            capacity = (capacity > INT_MAX / 2) ? ready : capacity * 2;
         
-        // Cater for the special case:
-        if (strcmp(textureFilename, "terrain.tga") != 0 && m != 25)
+        // What the frustum culling needs per triangle grows along with the buffers. There's
+        // never more than one batch per triangle:
+        SceneDrawBatches = (DrawBatch *) realloc(SceneDrawBatches, sizeof(DrawBatch) * (size_t) capacity);
+        SceneBatchEnds = (int *) realloc(SceneBatchEnds, sizeof(int) * (size_t) capacity);
+        SceneTriangleStamps = (unsigned int *) realloc(SceneTriangleStamps, sizeof(unsigned int) * (size_t) capacity);
+        SceneTriangleBatches = (int *) realloc(SceneTriangleBatches, sizeof(int) * (size_t) capacity);
+        SceneVisibleTriangles = (int *) realloc(SceneVisibleTriangles, sizeof(int) * (size_t) capacity);
+        SceneVisibleIndices = (GLuint *) realloc(SceneVisibleIndices, sizeof(GLuint) * 3 * (size_t) capacity);
+        if (!SceneDrawBatches || !SceneBatchEnds || !SceneTriangleStamps || !SceneTriangleBatches || !SceneVisibleTriangles || !SceneVisibleIndices)
         {
-            memcpy(textureFilename, textureFilename + 12, 36);
-            memset(textureFilename + 36, 0, sizeof(char) * 12);
+            printf("ERROR: Unable to allocate the scene buffers for %i triangles.\n\n", capacity);
+            exit(-1);
         }
-        else
+        memset(&SceneTriangleStamps[SceneBufferCapacity], 0, sizeof(unsigned int) * (size_t) (capacity - SceneBufferCapacity));
+        
+        // The vertex buffers start over at the new size:
+        if (!ScenePositionBuffer)
         {
-            if (m == 25)
-                textureFilename[8] = '/';
+            glGenBuffers(1, &ScenePositionBuffer);
+            glGenBuffers(1, &SceneNormalBuffer);
+            glGenBuffers(1, &SceneUVBuffer);
         }
-        
-        // Read the texture to memory
-        ReadTexture(noTextures + n, textureFilename);
-        
-        // Before finally freeing up the memory:
-        free(textureFilename);
+        glBindBuffer(GL_ARRAY_BUFFER, ScenePositionBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * POSITION_SIZE * (size_t) capacity, NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, SceneNormalBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * NORMAL_SIZE * 3 * (size_t) capacity, NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, SceneUVBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * UV_SIZE * (size_t) capacity, NULL, GL_STATIC_DRAW);
+        SceneBufferCapacity = capacity;
+        first = 0;
     }
     
-    // Increment the global number of textures
-    noTextures += localNoTextures;
-    
-    // We should now encounter a zero in the file. Verify this is the case:
-    fread(&zeroCheck, sizeof(int), 1, fp);
-    if (zeroCheck != 0)
-    {
-        printf("\nERROR: Error encountered entering filenames. Failed zero check.\n");
-        fclose(fp);
-        return 0;
-    }
+    // The position and UV streams are already laid out as one vertex after another:
+    glBindBuffer(GL_ARRAY_BUFFER, ScenePositionBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * POSITION_SIZE * (size_t) first, sizeof(float) * POSITION_SIZE * (size_t) (ready - first), ObjectPositions[first]);
+    glBindBuffer(GL_ARRAY_BUFFER, SceneUVBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * UV_SIZE * (size_t) first, sizeof(float) * UV_SIZE * (size_t) (ready - first), ObjectUVs[first]);
     
-    // Now proceed to load materials
-    for (n = 0; n < localNoMaterials; n++)
+    // Normals are per face, so repeat each one for all three vertices:
+    vertexNormals = malloc(sizeof(float) * NORMAL_SIZE * 3 * (size_t) (ready - first));
+    if (!vertexNormals)
     {
-        // Read the material index and then read the texture index:
-        fread(&matIdx, sizeof(int), 1, fp);
-        fread(&textIdx, sizeof(int), 1, fp);
-        
-        // Now create a material:
-        setMaterial(matIdx, textIdx);
+        printf("ERROR: Unable to allocate memory for the scene normals.\n\n");
+        exit(-1);
     }
+    for (n = first; n < ready; n++)
+        for (m = 0; m < 3; m++)
+            memcpy(vertexNormals[(n - first) * 3 + m], ObjectNormals[n], sizeof(float) * NORMAL_SIZE);
     
-    // Increment the global number of materials
-    noMaterials = localNoMaterials;
+    glBindBuffer(GL_ARRAY_BUFFER, SceneNormalBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * NORMAL_SIZE * 3 * (size_t) first, sizeof(float) * NORMAL_SIZE * 3 * (size_t) (ready - first), vertexNormals);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(vertexNormals);
     
-    // We should now encounter a zero in the file. Verify this is the case:
-    fread(&zeroCheck, sizeof(int), 1, fp);
-    if (zeroCheck != 0)
+    // Now carry the runs of the same material on over the new triangles:
+    for (n = SceneTrianglesUploaded; n < ready; n++)
     {
-        printf("\nERROR: Error encountered pairing materials with textures. Failed zero check.\n");
-        fclose(fp);
-        return 0;
+        if (noSceneDrawBatches > 0 && SceneDrawBatches[noSceneDrawBatches - 1].materialIdx == ObjectMaterials[n])
+            SceneDrawBatches[noSceneDrawBatches - 1].noTriangles++;
+        else
+        {
+            SceneDrawBatches[noSceneDrawBatches].firstTriangle = n;
+            SceneDrawBatches[noSceneDrawBatches].noTriangles = 1;
+            SceneDrawBatches[noSceneDrawBatches].materialIdx = ObjectMaterials[n];
+            noSceneDrawBatches++;
+        }
+        SceneTriangleBatches[n] = noSceneDrawBatches - 1;
     }
+    SceneTrianglesUploaded = ready;
+    
+    pthread_mutex_unlock(&Loading.lock);
+}
+
+// Draws the scene triangles uploaded so far. Once the tree is in, only those in the leaves
+// found by cullSceneToFrustum are drawn; until then every batch is drawn whole.
+void DrawScene(void)
+{
+    int n, m, triangleIdx, textureIdx, start, culled, noVisible = 0;
     
-    // Start the triangle loading process.
-    fread(&localNoTriangles, sizeof(int), 1, fp);
+    if (noSceneDrawBatches == 0)
+        return;
     
-    while(!feof(fp))
+    culled = (ViewLoadingStage == LOADING_DONE);
+    if (culled)
     {
-        // Check to see if we're over the limit:
-        if (localNoTriangles + noTriangles > MAX_TRIANGLES)
+        // Gather the visible triangles once each, counting how many fall in each batch:
+        for (n = 0; n < noSceneDrawBatches; n++)
+            SceneBatchEnds[n] = 0;
+        for (n = 0; n < noSceneVisibleLeaves; n++)
         {
-            printf("Too many triangles requested (%i). Current triangle limit set to %i.\n\n", localNoTriangles + noTriangles, MAX_TRIANGLES);
-            fclose(fp);
-            return 0;
+            for (m = LeafPrimitiveOffsets[SceneVisibleLeaves[n]]; m < LeafPrimitiveOffsets[SceneVisibleLeaves[n] + 1]; m++)
+            {
+                triangleIdx = LeafPrimitives[m];
+                if (triangleIdx < 0 || triangleIdx >= SceneTrianglesUploaded || SceneTriangleStamps[triangleIdx] == SceneCullFrame)
+                    continue;
+                
+                SceneTriangleStamps[triangleIdx] = SceneCullFrame;
+                SceneVisibleTriangles[noVisible++] = triangleIdx;
+                SceneBatchEnds[SceneTriangleBatches[triangleIdx]]++;
+            }
         }
         
-        for (n = 0; n < localNoTriangles; n++)
+        // Then lay them out batch by batch. Each batch's end moves up from its start as it fills:
+        for (n = 0, start = 0; n < noSceneDrawBatches; n++)
         {
-            // Start reading the parameters for each triangle
-            
-            // VECTOR A:
-            // Vector coords
-            fread(&x, sizeof(int), 1, fp);
-            fread(&y, sizeof(int), 1, fp);
-            fread(&z, sizeof(int), 1, fp);
-            // UV Coords
-            fread(&a, sizeof(int), 1, fp);
-            fread(&b, sizeof(int), 1, fp);
-            
-            // Add vector and UV coords to the DB
-            ObjectDB[noTriangles][TriangleAx] = (float) x / 65536.0;
-            ObjectDB[noTriangles][TriangleAy] = (float) y / 65536.0;
-            ObjectDB[noTriangles][TriangleAz] = (float) z / 65536.0;
-            ObjectDB[noTriangles][TriangleAu] = (float) a / 65536.0;
-            ObjectDB[noTriangles][TriangleAv] = (float) b / 65536.0;
-            
-            // VECTOR B:
-            // Vector coords
-            fread(&x, sizeof(int), 1, fp);
-            fread(&y, sizeof(int), 1, fp);
-            fread(&z, sizeof(int), 1, fp);
-            // UV Coords
-            fread(&a, sizeof(int), 1, fp);
-            fread(&b, sizeof(int), 1, fp);
-            
-            // Add vector and UV coords to the DB
-            ObjectDB[noTriangles][TriangleBx] = (float) x / 65536.0;
-            ObjectDB[noTriangles][TriangleBy] = (float) y / 65536.0;
-            ObjectDB[noTriangles][TriangleBz] = (float) z / 65536.0;
-            ObjectDB[noTriangles][TriangleBu] = (float) a / 65536.0;
-            ObjectDB[noTriangles][TriangleBv] = (float) b / 65536.0;
-            
-            // VECTOR C:
-            // Vector coords
-            fread(&x, sizeof(int), 1, fp);
-            fread(&y, sizeof(int), 1, fp);
-            fread(&z, sizeof(int), 1, fp);
-            // UV Coords
-            fread(&a, sizeof(int), 1, fp);
-            fread(&b, sizeof(int), 1, fp);
-            
-            // Add vector and UV coords to the DB
-            ObjectDB[noTriangles][TriangleCx] = (float) x / 65536.0;
-            ObjectDB[noTriangles][TriangleCy] = (float) y / 65536.0;
-            ObjectDB[noTriangles][TriangleCz] = (float) z / 65536.0;
-            ObjectDB[noTriangles][TriangleCu] = (float) a / 65536.0;
-            ObjectDB[noTriangles][TriangleCv] = (float) b / 65536.0;
-            
-            // TRIANGLE PARAMETERS:
-            // The dominant axis:
-            fread(&DominantAxisIdx, sizeof(int), 1, fp);
-            ObjectDB[noTriangles][TriangleDominantAxisIdx] = (float) DominantAxisIdx / 65536.0;
-            
-            // vmu, wmu, normdom:
-            fseek(fp, 9 * sizeof(int), SEEK_CUR);
-            
-            // VECTOR normcrvmuwmu:
-            // Vector coords
-            fread(&x, sizeof(int), 1, fp);
-            fread(&y, sizeof(int), 1, fp);
-            fread(&z, sizeof(int), 1, fp);
-            
-            // Add vector and UV coords to the DB
-            ObjectDB[noTriangles][Trianglenormcrvmuwmux] = (float) x / 65536.0;
-            ObjectDB[noTriangles][Trianglenormcrvmuwmuy] = (float) y / 65536.0;
-            ObjectDB[noTriangles][Trianglenormcrvmuwmuz] = (float) z / 65536.0;
-            
-            fread(&NUDom, sizeof(int), 1, fp);
-            fread(&NVDom, sizeof(int), 1, fp);
-            fread(&NDDom, sizeof(int), 1, fp);
-            fread(&BUDom, sizeof(int), 1, fp);
-            fread(&BVDom, sizeof(int), 1, fp);
-            fread(&CUDom, sizeof(int), 1, fp);
-            fread(&CVDom, sizeof(int), 1, fp);
-            
-            ObjectDB[noTriangles][TriangleNUDom] = (float) NUDom / 65536.0;
-            ObjectDB[noTriangles][TriangleNVDom] = (float) NVDom / 65536.0;
-            ObjectDB[noTriangles][TriangleNDDom] = (float) NDDom / 65536.0;
-            ObjectDB[noTriangles][TriangleBUDom] = (float) BUDom / 65536.0;
-            ObjectDB[noTriangles][TriangleBVDom] = (float) BVDom / 65536.0;
-            ObjectDB[noTriangles][TriangleCUDom] = (float) CUDom / 65536.0;
-            ObjectDB[noTriangles][TriangleCVDom] = (float) CVDom / 65536.0;
-            
-            noTriangles++;
+            m = SceneBatchEnds[n];
+            SceneBatchEnds[n] = start;
+            start += m;
         }
-        
-        // Next, read the material index for this batch of triangles:
-        fread(&matIdx, sizeof(int), 1, fp);
-        
-        // Triangles are now added. Assign material index to the triangles:
-        for (n = totalTriangles; n < noTriangles; n++)
-            ObjectDB[n][TriangleMaterialIdx] = (float) matIdx / 65536.0;
-        
-        // Then add this batch to the list:
-        totalTriangles += localNoTriangles;
-        
-        // This is followed by a zero check:
-        fread(&zeroCheck, sizeof(int), 1, fp);
-        if (zeroCheck != 0)
+        for (n = 0; n < noVisible; n++)
         {
-            printf("\nERROR: Error encountered pairing triangle points with UV values. Failed zero check.\n");
-            fclose(fp);
-            return 0;
+            start = SceneBatchEnds[SceneTriangleBatches[SceneVisibleTriangles[n]]]++;
+            for (m = 0; m < 3; m++)
+                SceneVisibleIndices[start * 3 + m] = (GLuint) (SceneVisibleTriangles[n] * 3 + m);
         }
-        // Now read the next number of triangle values. EOF will raise if this failed.
-        fread(&localNoTriangles, sizeof(int), 1, fp);
     }
     
-    // File read.
-    printf("Scenery file read successfully.\n\n");
-    
-    // Close the file pointer before terminating:
-    fclose(fp);
-    return 1;
-}
-
-void ReadTexture(int textureIdx, char *filename)
-{
-    int width, height, i, size, pixelbits, channels;
-    int a;
-    int *bitmap;
-    unsigned char *data;
+    glColor3f(0.5, 0.5, 0.5);
+    glPushMatrix();
     
-    // Open the file
-    FILE *f = fopen(filename, "rb");
-    
-    // Make sure it opened
-    if (f)
-    {
-        // Extract height and width from file header
-        unsigned char buffer[20];
-        fread(buffer, 1, 20, f);
-        width = *(buffer + 12) + 256 * *(buffer + 13);
-        height = *(buffer + 14) + 256 * *(buffer + 15);
-        pixelbits = *(buffer + 16);
-        fclose(f);
-        size = height * width;
-        
-        // Compute the number of channels to expect.
-        channels = (pixelbits == 32) ? 4 : 3;
-        
-        // Now to read the pixel data
-        f = fopen(filename, "rb");
-        data = (unsigned char *)malloc(sizeof(unsigned char) * size * channels + 1024);
-        fread(data, 1, size * channels + 1024, f);
-        fclose(f);
-        
-        // Convert 8 bits to fixed point
-        bitmap = malloc(sizeof(int) * size * channels);
-        for (i = 0; i < size; i++)
-        {
-            // shifting by 8 is equivalent to 256. Note that as 1 starts at bit 16 and char is up to 8 bits, shift by eight to left to align.
-            bitmap[i * channels + 0] = ((int)data[i * channels + 20]) << 8;
-            bitmap[i * channels + 1] = ((int)data[i * channels + 19]) << 8;
-            bitmap[i * channels + 2] = ((int)data[i * channels + 18]) << 8;
-            // Then record alpha if necessary
-            if (channels == 4)
-                bitmap[i * channels + 3] = ((int)data[i * channels + 21]) << 8;
-        }
-        Textures[textureIdx].data = bitmap;
-        
-        // Free up the data variable:
-        free(data);
-        
-        // Now populate the TextureDB array:
-        TextureDB[textureIdx][TextureHeight] = height;
-        TextureDB[textureIdx][TextureWidth] = width;
-        TextureDB[textureIdx][TextureAlpha] = (channels == 3) ? 0 : 1;
-        TextureDB[textureIdx][TextureMemStart] = 0;
-    }
-    else
+    // Point at the buffers uploaded earlier:
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, ScenePositionBuffer);
+    glVertexPointer(3, GL_FLOAT, 0, (void *) 0);
+    glBindBuffer(GL_ARRAY_BUFFER, SceneNormalBuffer);
+    glNormalPointer(GL_FLOAT, 0, (void *) 0);
+    if (SceneUVBuffer)
     {
-        printf("Error encountered opening texture file \"%s\".\n", filename);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, SceneUVBuffer);
+        glTexCoordPointer(2, GL_FLOAT, 0, (void *) 0);
     }
-}
-
-void setMaterial(int materialIdx, int textureIdx)
-{
-    int n;
     
-    // Set the texture index:
-    MaterialDB[materialIdx][MaterialTextureIndex] = (float) textureIdx / 65536.0;
+    // One call per material batch with anything in view, textured if its material is:
+    for (n = 0, start = 0; n < noSceneDrawBatches; n++)
+    {
+        if (!culled || SceneBatchEnds[n] > start)
+        {
+            textureIdx = materialTexture(SceneDrawBatches[n].materialIdx);
+            if (textureIdx >= 0)
+            {
+                glEnable(GL_TEXTURE_2D);
+                glBindTexture(GL_TEXTURE_2D, Textures[textureIdx].name);
+            }
+            else
+                glDisable(GL_TEXTURE_2D);
+            
+            if (culled)
+                glDrawElements(GL_TRIANGLES, (SceneBatchEnds[n] - start) * 3, GL_UNSIGNED_INT, &SceneVisibleIndices[start * 3]);
+            else
+                glDrawArrays(GL_TRIANGLES, SceneDrawBatches[n].firstTriangle * 3, SceneDrawBatches[n].noTriangles * 3);
+        }
+        if (culled)
+            start = SceneBatchEnds[n];
+    }
+    glDisable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
     
-    // Then set everything to defaults:
-    for (n = 0; n < 3; n ++)
-        MaterialDB[materialIdx][MaterialColour + n] = 0.7; // Light grey
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopMatrix();
 }
 
-void DrawScene(void)
+// Draws the ray cost image over the whole of the scene sub window.
+void DrawRayCostImage(void)
 {
-    int n;
-    
-    glColor3f(0.5, 0.5, 0.5);
-    glPushMatrix();
-    glBegin(GL_TRIANGLES);    
-        for (n = 0; n < noTriangles; n++)
-        {
-            glNormal3f(ObjectDB[n][Trianglenormcrvmuwmux], ObjectDB[n][Trianglenormcrvmuwmuy], ObjectDB[n][Trianglenormcrvmuwmuz]);
-            glVertex3f(ObjectDB[n][TriangleAx], ObjectDB[n][TriangleAy], ObjectDB[n][TriangleAz]);
-            glVertex3f(ObjectDB[n][TriangleBx], ObjectDB[n][TriangleBy], ObjectDB[n][TriangleBz]);
-            glVertex3f(ObjectDB[n][TriangleCx], ObjectDB[n][TriangleCy], ObjectDB[n][TriangleCz]);
-        }
-    glEnd();
-    glPopMatrix();
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glWindowPos2i(0, 0);
+    glPixelZoom((float) glutGet(GLUT_WINDOW_WIDTH) / (float) IMAGE_WIDTH, (float) glutGet(GLUT_WINDOW_HEIGHT) / (float) IMAGE_HEIGHT);
+    glDrawPixels(IMAGE_WIDTH, IMAGE_HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, RayCostImage);
+    glPixelZoom(1.0, 1.0);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_DEPTH_TEST);
 }
 
 // Display the clicked node information.
@@ -1244,6 +5414,14 @@ void DisplayNodeInfo(void)
     char charString[80];
     int startHeight = 550, pixSteps = 18;
     
+    // Until the tree is in, say how far it's got instead:
+    if (ViewLoadingStage < LOADING_DONE)
+    {
+        sprintf(charString, "Loading tree: %s...", LoadingStageNames[ViewLoadingStage]);
+        drawPanelText(5, startHeight, charString);
+        return;
+    }
+    
     // Set the colour before the position as it'll render with the last colour used!
     glColor3f(1.0, 1.0, 1.0);
     glRasterPos2i(5, -startHeight);
@@ -1254,6 +5432,25 @@ void DisplayNodeInfo(void)
     glRasterPos2i(5, -startHeight);
     sprintf(charString, "Primitives: %i", TreeNodeCounter[SelectedNodeIdx]);
     glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
+    startHeight += pixSteps;
+    glColor3f(1.0, 1.0, 1.0);
+    glRasterPos2i(5, -startHeight);
+    sprintf(charString, "SAH cost: %f (tree: %f)", NodeCosts[SelectedNodeIdx], NodeCosts[0]);
+    glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
+    
+    if (RaysCast)
+    {
+        startHeight += pixSteps;
+        glColor3f(1.0, 1.0, 1.0);
+        glRasterPos2i(5, -startHeight);
+        sprintf(charString, "Ray visits: %u (most: %u)", NodeVisitCounts[SelectedNodeIdx], NodeVisitMax);
+        glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
+        startHeight += pixSteps;
+        glColor3f(1.0, 1.0, 1.0);
+        glRasterPos2i(5, -startHeight);
+        sprintf(charString, "Measured cost: %f (tree: %f)", NodeMeasuredCosts[SelectedNodeIdx], NodeMeasuredCosts[0]);
+        glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
+    }
     
     if (TreeMatrix[SelectedNodeIdx][TREE_MATRIX_LEAF_NODE] < 0)
     {
@@ -1264,3 +5461,278 @@ void DisplayNodeInfo(void)
         glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
     }
 }
+
+// Says how many triangles are in, in the corner of the scene view, until the scenery is done.
+void DisplaySceneryProgress(void)
+{
+    char charString[80];
+    
+    if (ViewSceneryDone)
+        return;
+    
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glColor3f(1.0, 1.0, 1.0);
+    glWindowPos2i(5, 5);
+    sprintf(charString, "Loading scenery: %i triangles", ViewTrianglesReady);
+    glutBitmapString(GLUT_BITMAP_HELVETICA_12, charString);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Writes a line of white text into the tree view, measured down from the top.
+void drawPanelText(int xpos, int ypos, const char *string)
+{
+    glColor3f(1.0, 1.0, 1.0);
+    glRasterPos2i(xpos, -ypos);
+    glutBitmapString(GLUT_BITMAP_HELVETICA_12, string);
+}
+
+// Writes one row of the comparison panel: a name, the value for each tree and their difference.
+void drawComparisonRow(int ypos, const char *name, double valueA, double valueB, int decimals)
+{
+    char charString[40];
+    
+    drawPanelText(ComparisonColumns[0], ypos, name);
+    sprintf(charString, "%.*f", decimals, valueA);
+    drawPanelText(ComparisonColumns[1], ypos, charString);
+    sprintf(charString, "%.*f", decimals, valueB);
+    drawPanelText(ComparisonColumns[2], ypos, charString);
+    sprintf(charString, "%+.*f", decimals, valueB - valueA);
+    drawPanelText(ComparisonColumns[3], ypos, charString);
+}
+
+// Draws the comparison of the first two trees in place of the tree. The figures are set out
+// in columns for A, B and their difference, followed by a bar chart of the nodes at each depth.
+void DrawTreeComparison(void)
+{
+    static const char *bucketNames[LEAF_OCCUPANCY_BUCKETS] = {"0", "1", "2-3", "4-7", "8-15", "16-31", "32+"};
+    TreeSummary *a = &TreeSummaries[0], *b = &TreeSummaries[1];
+    char charString[80];
+    int n, startHeight = 5, pixSteps = 18, noLevels, maxCount = 1, depthA, depthB;
+    float rowHeight, top;
+    
+    drawPanelText(ComparisonColumns[0], startHeight, "Tree comparison (press c for the tree)");
+    startHeight += pixSteps;
+    sprintf(charString, "A: %.60s", Trees[0].filename);
+    drawPanelText(ComparisonColumns[0], startHeight, charString);
+    startHeight += pixSteps;
+    sprintf(charString, "B: %.60s", Trees[1].filename);
+    drawPanelText(ComparisonColumns[0], startHeight, charString);
+    startHeight += pixSteps * 2;
+    
+    drawPanelText(ComparisonColumns[1], startHeight, "A");
+    drawPanelText(ComparisonColumns[2], startHeight, "B");
+    drawPanelText(ComparisonColumns[3], startHeight, "B - A");
+    
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Nodes", a->noNodes, b->noNodes, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Depth", a->noDepthLevels, b->noDepthLevels, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Leaves", a->noLeaves, b->noLeaves, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Empty leaves", a->noEmptyLeaves, b->noEmptyLeaves, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Most leaf primitives", a->maxLeafPrimitives, b->maxLeafPrimitives, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Primitive references", a->noReferences, b->noReferences, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "Duplicated references", a->noReferences - a->noUniquePrimitives, b->noReferences - b->noUniquePrimitives, 0);
+    startHeight += pixSteps;
+    drawComparisonRow(startHeight, "SAH cost", a->sahCost, b->sahCost, 3);
+    
+    startHeight += pixSteps * 2;
+    drawPanelText(ComparisonColumns[0], startHeight, "Leaves by primitive count:");
+    for (n = 0; n < LEAF_OCCUPANCY_BUCKETS; n++)
+    {
+        startHeight += pixSteps;
+        drawComparisonRow(startHeight, bucketNames[n], a->leafOccupancy[n], b->leafOccupancy[n], 0);
+    }
+    
+    // The depth chart fills whatever height is left, with A's bar above B's for each depth:
+    startHeight += pixSteps * 2;
+    drawPanelText(ComparisonColumns[0], startHeight, "Nodes by depth:");
+    startHeight += pixSteps / 2;
+    
+    noLevels = (a->noDepthLevels > b->noDepthLevels) ? a->noDepthLevels : b->noDepthLevels;
+    for (n = 0; n < noLevels; n++)
+    {
+        if (n < a->noDepthLevels && a->depthCounts[n] > maxCount)
+            maxCount = a->depthCounts[n];
+        if (n < b->noDepthLevels && b->depthCounts[n] > maxCount)
+            maxCount = b->depthCounts[n];
+    }
+    
+    rowHeight = (float) (SCREEN_HEIGHT - 2 * BORDER_SIZE - 2 * TREE_VIEW_MARGIN - startHeight) / (float) (noLevels > 0 ? noLevels : 1);
+    if (rowHeight > pixSteps)
+        rowHeight = pixSteps;
+    
+    for (n = 0; n < noLevels; n++)
+    {
+        depthA = (n < a->noDepthLevels) ? a->depthCounts[n] : 0;
+        depthB = (n < b->noDepthLevels) ? b->depthCounts[n] : 0;
+        top = -(float) startHeight - rowHeight * (float) n;
+        
+        glColor3f(COMPARISON_TREE_A_COLOUR_R, COMPARISON_TREE_A_COLOUR_G, COMPARISON_TREE_A_COLOUR_B);
+        glRectf((float) ComparisonColumns[0], top, (float) ComparisonColumns[0] + COMPARISON_BAR_WIDTH * (float) depthA / (float) maxCount, top - rowHeight * 0.45);
+        glColor3f(COMPARISON_TREE_B_COLOUR_R, COMPARISON_TREE_B_COLOUR_G, COMPARISON_TREE_B_COLOUR_B);
+        glRectf((float) ComparisonColumns[0], top - rowHeight * 0.45, (float) ComparisonColumns[0] + COMPARISON_BAR_WIDTH * (float) depthB / (float) maxCount, top - rowHeight * 0.9);
+    }
+}
+
+// Writes a string as a quoted JSON string.
+void writeJSONString(FILE *fp, const char *string)
+{
+    fputc('"', fp);
+    for (; string && *string; string++)
+    {
+        if (*string == '"' || *string == '\\')
+            fprintf(fp, "\\%c", *string);
+        else if ((unsigned char) *string < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char) *string);
+        else
+            fputc(*string, fp);
+    }
+    fputc('"', fp);
+}
+
+// Writes a string as a quoted CSV field.
+void writeCSVString(FILE *fp, const char *string)
+{
+    fputc('"', fp);
+    for (; string && *string; string++)
+    {
+        if (*string == '"')
+            fputc('"', fp);
+        fputc(*string, fp);
+    }
+    fputc('"', fp);
+}
+
+// Writes the statistics of the loaded tree to StatsFilename, or to stdout if it isn't set,
+// in the format given by StatsFormat. This needs the depth and node counters, the depth
+// assignment and the node costs. Returns 0 on failure.
+int WriteTreeStatistics(char *treeFilename, char *sceneFilename)
+{
+    FILE *fp;
+    int n, noNodes = 0, noJunctions = 0, noLeaves = 0, noEmptyLeaves = 0, maxLeafPrimitives = 0, depth;
+    int *depthLeaves, *depthPrimitives;
+    long long noReferences = 0, leafDepthTotal = 0;
+    double meanLeafPrimitives, meanLeafDepth;
+    
+    depthLeaves = (int *) calloc(noTreeDepthLevels + 1, sizeof(int));
+    depthPrimitives = (int *) calloc(noTreeDepthLevels + 1, sizeof(int));
+    if (!depthLeaves || !depthPrimitives)
+    {
+        printf("ERROR: Unable to allocate memory for the tree statistics.\n\n");
+        free(depthLeaves);
+        free(depthPrimitives);
+        return 0;
+    }
+    
+    // Only count the nodes that can be reached from the root:
+    for (n = 0; n < noTreeMatrixEntries; n++)
+    {
+        if (TreeDepthIndex[n] < 0)
+            continue;
+        
+        noNodes++;
+        if (TreeMatrix[n][TREE_MATRIX_LEAF_NODE] < 0)
+        {
+            noJunctions++;
+            continue;
+        }
+        
+        depth = TreeDepthAssignment[n];
+        noLeaves++;
+        depthLeaves[depth]++;
+        depthPrimitives[depth] += TreeNodeCounter[n];
+        noReferences += TreeNodeCounter[n];
+        leafDepthTotal += depth;
+        if (TreeNodeCounter[n] == 0)
+            noEmptyLeaves++;
+        if (TreeNodeCounter[n] > maxLeafPrimitives)
+            maxLeafPrimitives = TreeNodeCounter[n];
+    }
+    meanLeafPrimitives = (noLeaves > 0) ? (double) noReferences / (double) noLeaves : 0.0;
+    meanLeafDepth = (noLeaves > 0) ? (double) leafDepthTotal / (double) noLeaves : 0.0;
+    
+    if (StatsFilename)
+    {
+        fp = fopen(StatsFilename, "w");
+        if (!fp)
+        {
+            printf("ERROR: Unable to open \"%s\" for writing.\n\n", StatsFilename);
+            free(depthLeaves);
+            free(depthPrimitives);
+            return 0;
+        }
+    }
+    else
+    {
+        fp = StatsOutput ? StatsOutput : stdout;
+    }
+    
+    if (StatsFormat == STATS_FORMAT_CSV)
+    {
+        // A header and a single row so that the output of many runs can be concatenated:
+        fprintf(fp, "tree,scene,nodes,junction_nodes,leaf_nodes,empty_leaf_nodes,primitive_references,max_leaf_primitives,mean_leaf_primitives,depth_levels,mean_leaf_depth,sah_cost,sah_traversal_cost,sah_intersection_cost,triangles,materials,textures,nodes_per_depth\n");
+        writeCSVString(fp, treeFilename);
+        fputc(',', fp);
+        writeCSVString(fp, SceneryLoaded ? sceneFilename : "");
+        fprintf(fp, ",%i,%i,%i,%i,%lld,%i,%f,%i,%f,%f,%f,%f,%i,%i,%i,", noNodes, noJunctions, noLeaves, noEmptyLeaves, noReferences, maxLeafPrimitives, meanLeafPrimitives, noTreeDepthLevels, meanLeafDepth, NodeCosts[0], SAHTraversalCost, SAHIntersectionCost, noTriangles, noMaterials, noTextures);
+        for (n = 0; n < noTreeDepthLevels; n++)
+            fprintf(fp, "%s%i", (n > 0) ? ";" : "", TreeDepthCounter[n]);
+        fprintf(fp, "\n");
+    }
+    else
+    {
+        fprintf(fp, "{\n    \"tree\": ");
+        writeJSONString(fp, treeFilename);
+        fprintf(fp, ",\n    \"scene\": ");
+        if (SceneryLoaded)
+            writeJSONString(fp, sceneFilename);
+        else
+            fprintf(fp, "null");
+        fprintf(fp, ",\n");
+        fprintf(fp, "    \"nodes\": %i,\n", noNodes);
+        fprintf(fp, "    \"junction_nodes\": %i,\n", noJunctions);
+        fprintf(fp, "    \"leaf_nodes\": %i,\n", noLeaves);
+        fprintf(fp, "    \"empty_leaf_nodes\": %i,\n", noEmptyLeaves);
+        fprintf(fp, "    \"primitive_references\": %lld,\n", noReferences);
+        fprintf(fp, "    \"max_leaf_primitives\": %i,\n", maxLeafPrimitives);
+        fprintf(fp, "    \"mean_leaf_primitives\": %f,\n", meanLeafPrimitives);
+        fprintf(fp, "    \"depth_levels\": %i,\n", noTreeDepthLevels);
+        fprintf(fp, "    \"mean_leaf_depth\": %f,\n", meanLeafDepth);
+        fprintf(fp, "    \"sah_cost\": %f,\n", NodeCosts[0]);
+        fprintf(fp, "    \"sah_traversal_cost\": %f,\n", SAHTraversalCost);
+        fprintf(fp, "    \"sah_intersection_cost\": %f,\n", SAHIntersectionCost);
+        fprintf(fp, "    \"triangles\": %i,\n", noTriangles);
+        fprintf(fp, "    \"materials\": %i,\n", noMaterials);
+        fprintf(fp, "    \"textures\": %i,\n", noTextures);
+        fprintf(fp, "    \"depths\": [\n");
+        for (n = 0; n < noTreeDepthLevels; n++)
+            fprintf(fp, "        {\"depth\": %i, \"nodes\": %i, \"leaf_nodes\": %i, \"primitive_references\": %i}%s\n", n, TreeDepthCounter[n], depthLeaves[n], depthPrimitives[n], (n < noTreeDepthLevels - 1) ? "," : "");
+        fprintf(fp, "    ]\n}\n");
+    }
+    
+    free(depthLeaves);
+    free(depthPrimitives);
+    
+    if (StatsFilename)
+    {
+        if (fclose(fp) != 0)
+        {
+            printf("ERROR: Unable to finish writing \"%s\".\n\n", StatsFilename);
+            return 0;
+        }
+        printf("Statistics written to \"%s\".\n\n", StatsFilename);
+    }
+    else
+    {
+        fflush(fp);
+    }
+    
+    return 1;
+}
@@ -18,10 +18,194 @@
 #define SCREEN_HEIGHT                           800
 #define BORDER_SIZE                             5
 
+// Scene view projection. Picking unprojects through the same one.
+#define SCENE_VIEW_FOV                          90.0
+#define SCENE_VIEW_ASPECT                       1.0
+#define SCENE_VIEW_NEAR                         3.0
+#define SCENE_VIEW_FAR                          200.0
+
 // Key code:
 #define ESCAPE_KEY                              27
 
+// Tree file layout. The header holds the scene bounding box followed by five counters.
+#define TREE_FILE_HEADER_SIZE                   (TREE_BOUNDING_BOX_ARRAY_SIZE + 5)
+#define TREE_FILE_SPLIT_LIST_ENTRIES            (MAX_TRIANGLES * 2 + 8)
+
+// Compact tree file (version 2). A header and section table are followed by sections of
+// varint coded entries. Only the populated entries are stored. Create one with -convert.
+#define TREE_FILE_MAGIC                         0x52544154 // "TATR"
+#define TREE_FILE_VERSION                       2
+#define TREE_FILE_MAX_SECTIONS                  8
+#define TREE_SECTION_NODES                      1
+#define TREE_SECTION_LEAF_PRIMITIVES            2
+#define TREE_SECTION_TREE_LIST                  3
+#define TREE_SECTION_SPLIT_LIST                 4
+// A node's entry starts with its split axis, or this if it's a leaf:
+#define TREE_NODE_LEAF_TAG                      3
+// Longest varint, for a 32-bit value:
+#define VARINT_MAX_BYTES                        5
+
+// Number of triangles the object database is first allocated with. It doubles from here.
+#define OBJECT_DB_INITIAL_CAPACITY              65536
+
+// Number of entries a traversal stack starts with. It doubles from here.
+#define TRAVERSAL_STACK_INITIAL_SIZE            64
+
+// Number of subtrees the tree statistics are split into for each thread.
+#define TREE_STATS_TASKS_PER_THREAD             8
+
+// Default surface area heuristic costs. These can be set with -traversal and -intersection.
+#define SAH_TRAVERSAL_COST                      1.0
+#define SAH_INTERSECTION_COST                   1.5
+
+// Statistics formats for headless mode, chosen with -format json or -format csv.
+#define STATS_FORMAT_JSON                       0
+#define STATS_FORMAT_CSV                        1
+
+// Ray caster. Press r to cast rays from the scene camera, h to toggle the heatmap and p to
+// switch between packet and scalar casting.
+#define RAYCAST_FOV                             90.0
+#define RAYCAST_TILE_SIZE                       32
+#define RAY_PACKET_SIZE                         4
+#define RAYCAST_BENCHMARK_RUNS                  3
+#define RAYCAST_EPSILON                         1e-4
+// Work recorded for each ray:
+#define RayStatsNodes                           0
+#define RayStatsLeaves                          1
+#define RayStatsTriangles                       2
+#define RAY_STATS_SIZE                          3
+
+// Tree comparison. Giving -tree two files loads both, and c switches the tree view over to
+// a panel comparing them. Leaves are grouped by occupancy as 0, 1, 2-3, 4-7 and so on.
+#define MAX_COMPARED_TREES                      2
+#define LEAF_OCCUPANCY_BUCKETS                  7
+#define COMPARISON_BAR_WIDTH                    300.0
+#define COMPARISON_TREE_A_COLOUR_R              1.0
+#define COMPARISON_TREE_A_COLOUR_G              0.0
+#define COMPARISON_TREE_A_COLOUR_B              0.0
+#define COMPARISON_TREE_B_COLOUR_R              0.0
+#define COMPARISON_TREE_B_COLOUR_G              0.5
+#define COMPARISON_TREE_B_COLOUR_B              1.0
+
+// Upper limit on the number of worker threads
+#define MAX_THREADS                             64
+
+// Scenery file triangle record layout (in 16.16 fixed point ints). Offsets 16 to 24 hold
+// vmu, wmu and normdom, which aren't used.
+#define SceneryRecordA                          0
+#define SceneryRecordB                          5
+#define SceneryRecordC                          10
+#define SceneryRecordDominantAxisIdx            15
+#define SceneryRecordNormal                     25
+#define SceneryRecordNUDom                      28
+#define SceneryRecordNVDom                      29
+#define SceneryRecordNDDom                      30
+#define SceneryRecordBUDom                      31
+#define SceneryRecordBVDom                      32
+#define SceneryRecordCUDom                      33
+#define SceneryRecordCVDom                      34
+#define SCENERY_RECORD_SIZE                     35
+
+// Scenery decoding work sizes
+#define SCENERY_DECODE_CHUNK                    4096
+#define SCENERY_DECODE_ROUND_TRIANGLES          262144
+#define SCENERY_DECODE_ROUND_BATCHES            256
+
+// Textures are read by this many threads while the triangles are parsed, and kept as 8-bit RGBA:
+#define TEXTURE_LOADER_THREADS                  4
+#define TEXTURE_CHANNELS                        4
+// Uncompressed true colour TGA files:
+#define TGA_HEADER_SIZE                         18
+#define TGA_TYPE_TRUE_COLOUR                    2
+
+// Object stream offsets. The object database is held as separate streams rather than the
+// TRIANGLE_SIZE records of raytracer.h.
+// Position stream (vertices A, B and C):
+#define PositionAx                              0
+#define PositionAy                              1
+#define PositionAz                              2
+#define PositionBx                              3
+#define PositionBy                              4
+#define PositionBz                              5
+#define PositionCx                              6
+#define PositionCy                              7
+#define PositionCz                              8
+#define POSITION_SIZE                           9
+
+// Normal stream:
+#define NormalX                                 0
+#define NormalY                                 1
+#define NormalZ                                 2
+#define NORMAL_SIZE                             3
+
+// Intersection stream (Wald projection coefficients):
+#define IntersectionDominantAxisIdx             0
+#define IntersectionNUDom                       1
+#define IntersectionNVDom                       2
+#define IntersectionNDDom                       3
+#define IntersectionBUDom                       4
+#define IntersectionBVDom                       5
+#define IntersectionCUDom                       6
+#define IntersectionCVDom                       7
+#define INTERSECTION_SIZE                       8
+
+// UV stream:
+#define UVAu                                    0
+#define UVAv                                    1
+#define UVBu                                    2
+#define UVBv                                    3
+#define UVCu                                    4
+#define UVCv                                    5
+#define UV_SIZE                                 6
+
+// Scene cache file
+#define SCENE_CACHE_MAGIC                       0x43534154 // "TASC"
+#define SCENE_CACHE_VERSION                     5
+#define SCENE_CACHE_ALIGNMENT                   4096
+#define SCENE_CACHE_HASH_BLOCK                  (1 << 20)
+
+// Frame scheduling. Reasons a sub window may need redrawing:
+#define REDRAW_CAMERA_MOVED                     1
+#define REDRAW_SELECTION_CHANGED                2
+#define REDRAW_TREE_RELOADED                    4
+#define REDRAW_RAYS_CAST                        8
+#define REDRAW_PANEL_TOGGLED                    16
+#define REDRAW_TREE_VIEW_MOVED                  32
+#define REDRAW_SCENERY_STREAMED                 64
+// Which of the reasons affect each sub window:
+#define REDRAW_TREE_VIEW                        (REDRAW_SELECTION_CHANGED | REDRAW_TREE_RELOADED | REDRAW_RAYS_CAST | REDRAW_PANEL_TOGGLED | REDRAW_TREE_VIEW_MOVED)
+#define REDRAW_SCENE_VIEW                       (REDRAW_CAMERA_MOVED | REDRAW_SELECTION_CHANGED | REDRAW_TREE_RELOADED | REDRAW_RAYS_CAST | REDRAW_SCENERY_STREAMED)
+// Upper limit on redraws per second while the camera is moving
+#define TARGET_FRAME_RATE                       30
+
+// Background loading. The stages the tree goes through, in order, before it's ready:
+#define LOADING_TREES                           0
+#define LOADING_COUNTERS                        1
+#define LOADING_LAYOUT                          2
+#define LOADING_BOXES                           3
+#define LOADING_COSTS                           4
+#define LOADING_COMPARISON                      5
+#define LOADING_DONE                            6
+// How often the window checks on the loaders, in milliseconds:
+#define LOADING_POLL_INTERVAL                   100
+// Triangles the scene's vertex buffers have room for at first. They double as the scenery streams in.
+#define SCENE_BUFFER_INITIAL_TRIANGLES          65536
+
 // Graphics defaults
+#define TREE_VIEW_MARGIN                        10
+#define TREE_VIEW_WIDTH                         (SCREEN_WIDTH / 3 - BORDER_SIZE / 2)
+#define TREE_VIEW_HEIGHT                        (SCREEN_HEIGHT - 2 * BORDER_SIZE)
+// Tree view zooming, in pixels per unit of the layout:
+#define TREE_VIEW_ZOOM_STEP                     1.25
+#define TREE_VIEW_MIN_ZOOM                      0.0001
+#define TREE_VIEW_MAX_ZOOM                      16.0
+// Subtrees narrower than this many pixels are drawn as a single glyph:
+#define TREE_VIEW_COLLAPSE_WIDTH                1.0
+// Rough width of a character in a glyph's label, used to stop labels overlapping:
+#define TREE_VIEW_LABEL_CHAR_WIDTH              6
+// GLUT reports the mouse wheel as these buttons:
+#define MOUSE_WHEEL_UP                          3
+#define MOUSE_WHEEL_DOWN                        4
 #define NODE_DRAW_SQUARE_SIZE                   10.0
 #define NODE_DRAW_SQUARE_COLOUR_R               1.0
 #define NODE_DRAW_SQUARE_COLOUR_G               0.0
@@ -32,9 +216,17 @@
 #define NODE_DRAW_LINE_COLOUR_R                 0.0
 #define NODE_DRAW_LINE_COLOUR_G                 1.0
 #define NODE_DRAW_LINE_COLOUR_B                 0.0
+#define NODE_DRAW_GLYPH_COLOUR_R                1.0
+#define NODE_DRAW_GLYPH_COLOUR_G                1.0
+#define NODE_DRAW_GLYPH_COLOUR_B                0.0
 #define AABB_DRAW_LINE_COLOUR_R                 0.0
 #define AABB_DRAW_LINE_COLOUR_G                 0.5
 #define AABB_DRAW_LINE_COLOUR_B                 1.0
 #define AABB_DRAW_LINE_SELECTED_COLOUR_R        1.0
 #define AABB_DRAW_LINE_SELECTED_COLOUR_G        1.0
 #define AABB_DRAW_LINE_SELECTED_COLOUR_B        0.0
+// Twelve box edges plus the four lines of the split plane, two vertices each:
+#define BOX_VERTICES_PER_NODE                   32
+// The scene view's frustum, as planes facing inwards, and a mask with a bit for each:
+#define FRUSTUM_PLANES                          6
+#define FRUSTUM_ALL_PLANES                      ((1 << FRUSTUM_PLANES) - 1)